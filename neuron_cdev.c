@@ -9,11 +9,16 @@
 #define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
 
 #include <linux/kernel.h>
+#include <linux/module.h>
 #include <linux/poll.h>
 #include <linux/cdev.h>
 #include <linux/sched.h>
 #include <linux/device.h>
 #include <linux/pci.h>
+#include <linux/xarray.h>
+#include <linux/rbtree.h>
+#include <linux/rwsem.h>
+#include <linux/sort.h>
 
 #include "neuron_ioctl.h"
 #include "neuron_device.h"
@@ -25,6 +30,21 @@
 #include "v1/address_map.h"
 #include "v1/fw_io.h"
 
+int mempool_device_allocator = MEMPOOL_ALLOCATOR_GENPOOL;
+
+module_param(mempool_device_allocator, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(mempool_device_allocator,
+		 "Device memory allocator used for devices initialized afterwards: 0 - gen_pool, 1 - buddy");
+
+int ncdev_buf_copy_depth = 4;
+module_param(ncdev_buf_copy_depth, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(ncdev_buf_copy_depth,
+		 "Staging buffers in flight in a MEM_BUF_COPY of device memory, 1 - no overlap of user copy and DMA");
+
+int ncdev_buf_copy_chunk_kb = 256;
+module_param(ncdev_buf_copy_chunk_kb, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(ncdev_buf_copy_chunk_kb, "Size in KiB of each MEM_BUF_COPY staging buffer, at most 256");
+
 static dev_t neuron_dev;
 static int major;
 static struct class *neuron_dev_class;
@@ -35,6 +55,7 @@ static struct class *neuron_dev_class;
 struct ncdev {
 	int minor;
 	int open_count; // number of times this node is opened.
+	int closing; // files being closed, the device is torn down after the last one is done
 	struct cdev *cdev;
 	struct neuron_device *ndev; // neuron device associated with this device node.
 };
@@ -42,14 +63,121 @@ struct ncdev {
 /* char device nodes created for each device. */
 static struct ncdev devnodes[NEURON_MAX_DEV_NODES];
 
-static u64 ncdev_mem_chunk_to_mem_handle(struct mem_chunk *mc)
+/* State of an open file of a device node.
+ *
+ * Memory handles given to user space are (generation << 32 | index) of the chunk in mem_handles.
+ * The generation is stored in the chunk, so a stale or forged handle fails the lookup instead of
+ * being dereferenced.
+ *
+ * Chunks looked up by handle are used without a reference. mem_lock is held for read from the
+ * lookup until the ioctl is done with the chunk, and for write while a handle is removed, so a
+ * chunk is never freed under another thread of the owner.
+ */
+struct ncdev_file {
+	struct ncdev *ncd; // device node which was opened
+	struct xarray mem_handles; // memory chunks allocated through this file
+	atomic_t mem_handle_gen; // generation of the last created handle
+	struct rw_semaphore mem_lock; // see above
+	struct mutex mem_reg_lock; // protects mem_regs
+	struct rb_root mem_regs; // registered user buffers, see ncdev_mem_register()
+};
+
+/* A user buffer registered through a file, keyed by (addr, size).
+ *
+ * Registering the same buffer again only takes a reference, so the pages are pinned and DMA
+ * mapped once per buffer however often the application registers it.
+ */
+struct ncdev_mem_reg {
+	struct rb_node node; // node in ncdev_file.mem_regs
+	u64 addr; // user address of the buffer
+	u64 size; // size of the buffer
+	u64 mem_handle; // handle of the registered chunk
+	u32 refs; // number of registrations not yet deregistered
+};
+
+static int ncdev_mem_handle_create(struct ncdev_file *f, struct mem_chunk *mc, u64 *mh)
 {
-	return (u64)mc;
+	u32 index;
+	int ret;
+
+	mc->handle_gen = atomic_inc_return(&f->mem_handle_gen);
+	ret = xa_alloc(&f->mem_handles, &index, mc, xa_limit_32b, GFP_KERNEL);
+	if (ret)
+		return ret;
+	*mh = ((u64)mc->handle_gen << 32) | index;
+	return 0;
 }
 
-static struct mem_chunk *ncdev_mem_handle_to_mem_chunk(u64 mh)
+/**
+ * ncdev_mem_handle_to_mem_chunk() - Look up the chunk of a handle.
+ * Caller must hold f->mem_lock for as long as it uses the chunk.
+ */
+static struct mem_chunk *ncdev_mem_handle_to_mem_chunk(struct ncdev_file *f, u64 mh)
 {
-	return (struct mem_chunk *)mh;
+	struct mem_chunk *mc = xa_load(&f->mem_handles, (u32)mh);
+
+	if (mc == NULL || mc->handle_gen != (u32)(mh >> 32))
+		return NULL;
+	return mc;
+}
+
+/**
+ * __ncdev_mem_handle_remove() - Remove the handle and return its chunk, which the caller must free.
+ *
+ * Waits for the ioctls using chunks of the file, once the handle is gone no new one can find it.
+ *
+ * @f: file the handle belongs to
+ * @mh: handle to remove
+ * @user: true to remove a registered user buffer, false for allocated memory
+ *
+ * Return: the chunk or NULL if the handle is invalid, of the other kind or was already removed.
+ */
+static struct mem_chunk *__ncdev_mem_handle_remove(struct ncdev_file *f, u64 mh, bool user)
+{
+	struct mem_chunk *mc;
+
+	down_write(&f->mem_lock);
+	mc = ncdev_mem_handle_to_mem_chunk(f, mh);
+	if (mc && (!(mc->alloc_flags & MC_ALLOC_USER) != !user ||
+		   xa_cmpxchg(&f->mem_handles, (u32)mh, mc, NULL, 0) != mc))
+		mc = NULL;
+	up_write(&f->mem_lock);
+	return mc;
+}
+
+/**
+ * ncdev_mem_handle_remove() - Remove the handle of allocated memory.
+ *
+ * Registered user buffers are only removed by ncdev_mem_deregister().
+ */
+static struct mem_chunk *ncdev_mem_handle_remove(struct ncdev_file *f, u64 mh)
+{
+	return __ncdev_mem_handle_remove(f, mh, false);
+}
+
+// Number of chunks freed at once when a file is closed.
+#define NCDEV_FREE_BATCH 32
+
+/**
+ * ncdev_mem_handles_free_all() - Free all the memory allocated through the file.
+ */
+static void ncdev_mem_handles_free_all(struct ncdev_file *f)
+{
+	struct mem_chunk *mcs[NCDEV_FREE_BATCH];
+	struct mem_chunk *mc;
+	unsigned long index;
+	u32 count = 0;
+
+	xa_for_each (&f->mem_handles, index, mc) {
+		mcs[count++] = mc;
+		if (count == NCDEV_FREE_BATCH) {
+			mc_free_batch(mcs, count);
+			count = 0;
+		}
+	}
+	if (count)
+		mc_free_batch(mcs, count);
+	xa_destroy(&f->mem_handles);
 }
 
 static int ncdev_dma_engine_init(struct neuron_device *nd, void *param)
@@ -87,7 +215,7 @@ static int ncdev_dma_engine_get_state(struct neuron_device *nd, void *param)
 	return copy_to_user(arg.state, &state, sizeof(state));
 }
 
-static int ncdev_dma_queue_init(struct neuron_device *nd, void *param)
+static int ncdev_dma_queue_init(struct neuron_device *nd, struct ncdev_file *f, void *param)
 {
 	struct neuron_ioctl_dma_queue_init arg;
 	struct mem_chunk *rx_mc;
@@ -99,21 +227,29 @@ static int ncdev_dma_queue_init(struct neuron_device *nd, void *param)
 	if (ret)
 		return -EACCES;
 
-	rx_mc = ncdev_mem_handle_to_mem_chunk(arg.rx_handle);
-	tx_mc = ncdev_mem_handle_to_mem_chunk(arg.tx_handle);
-	if (arg.rxc_handle)
-		rxc_mc = ncdev_mem_handle_to_mem_chunk(arg.rxc_handle);
-	else
+	rx_mc = ncdev_mem_handle_to_mem_chunk(f, arg.rx_handle);
+	tx_mc = ncdev_mem_handle_to_mem_chunk(f, arg.tx_handle);
+	if (rx_mc == NULL || tx_mc == NULL)
+		return -EINVAL;
+	if (arg.rxc_handle) {
+		rxc_mc = ncdev_mem_handle_to_mem_chunk(f, arg.rxc_handle);
+		if (rxc_mc == NULL)
+			return -EINVAL;
+	} else {
 		rxc_mc = NULL;
+	}
+	// the rings must be contiguous for the device
+	if (rx_mc->sg || tx_mc->sg || (rxc_mc && rxc_mc->sg))
+		return -EINVAL;
 	ret = ndmar_queue_init(nd, arg.eng_id, arg.qid, arg.tx_desc_count, arg.rx_desc_count, tx_mc,
 			       rx_mc, rxc_mc, arg.axi_port);
 	return ret;
 }
 
-static int ncdev_dma_copy_descriptors(struct neuron_device *nd, void *param)
+static int ncdev_dma_copy_descriptors(struct neuron_device *nd, struct ncdev_file *f, void *param)
 {
 	struct neuron_ioctl_dma_copy_descriptors arg;
-	struct mem_chunk *src_mc;
+	struct ndma_staging_buf *buf = NULL;
 	u32 offset = 0, copy_size = 0;
 	int remaining, ret;
 
@@ -121,7 +257,7 @@ static int ncdev_dma_copy_descriptors(struct neuron_device *nd, void *param)
 	if (ret)
 		return ret;
 
-	struct mem_chunk *mc = ncdev_mem_handle_to_mem_chunk(arg.mem_handle);
+	struct mem_chunk *mc = ncdev_mem_handle_to_mem_chunk(f, arg.mem_handle);
 	if (!mc)
 		return -EINVAL;
 	// check access is within the range.
@@ -131,18 +267,18 @@ static int ncdev_dma_copy_descriptors(struct neuron_device *nd, void *param)
 	}
 
 	remaining = arg.num_descs * sizeof(union udma_desc);
-	ret = mc_alloc(&nd->mpset, &src_mc, MAX_DMA_DESC_SIZE, MEM_LOC_HOST, 0, 0, mc->nc_id);
+	ret = ndmar_staging_get(nd, MAX_DMA_DESC_SIZE, mc->nc_id, &buf);
 	if (ret) {
 		ret = -ENOMEM;
 		goto out;
 	}
 	while (remaining) {
 		copy_size = remaining < MAX_DMA_DESC_SIZE ? remaining : MAX_DMA_DESC_SIZE;
-		ret = copy_from_user(src_mc->va, arg.buffer + offset, copy_size);
+		ret = copy_from_user(buf->mc->va, arg.buffer + offset, copy_size);
 		if (ret) {
 			break;
 		}
-		ret = ndma_memcpy_dma_copy_descriptors(nd, src_mc->va, 0, mc, arg.offset + offset,
+		ret = ndma_memcpy_dma_copy_descriptors(nd, buf->mc->va, 0, mc, arg.offset + offset,
 						       copy_size, arg.queue_type);
 		if (ret) {
 			break;
@@ -151,7 +287,8 @@ static int ncdev_dma_copy_descriptors(struct neuron_device *nd, void *param)
 		offset += copy_size;
 	}
 out:
-	mc_free(&src_mc);
+	if (buf)
+		ndmar_staging_put(nd, buf);
 	return ret;
 }
 
@@ -266,7 +403,7 @@ static int ncdev_dma_descriptor_copyout(struct neuron_device *nd, void *param)
 	return ret;
 }
 
-static int ncdev_mem_alloc(struct neuron_device *nd, void *param)
+static int ncdev_mem_alloc(struct neuron_device *nd, struct ncdev_file *f, void *param)
 {
 	struct neuron_ioctl_mem_alloc mem_alloc_arg;
 	enum mem_location location;
@@ -283,15 +420,20 @@ static int ncdev_mem_alloc(struct neuron_device *nd, void *param)
 	else
 		location = MEM_LOC_DEVICE;
 	ret = mc_alloc(&nd->mpset, &mc, mem_alloc_arg.size, location, mem_alloc_arg.dram_channel,
-		       mem_alloc_arg.dram_region, mem_alloc_arg.nc_id);
+		       mem_alloc_arg.dram_region, mem_alloc_arg.nc_id, 0);
 	if (ret)
 		return ret;
 
 	trace_ioctl_mem_alloc(nd, mc);
 
-	mh = ncdev_mem_chunk_to_mem_handle(mc);
-	ret = copy_to_user(mem_alloc_arg.mem_handle, &mh, sizeof(mc));
+	ret = ncdev_mem_handle_create(f, mc, &mh);
+	if (ret) {
+		mc_free(&mc);
+		return ret;
+	}
+	ret = copy_to_user(mem_alloc_arg.mem_handle, &mh, sizeof(mh));
 	if (ret) {
+		mc = ncdev_mem_handle_remove(f, mh);
 		mc_free(&mc);
 		return ret;
 	}
@@ -306,7 +448,7 @@ static int ncdev_mem_alloc(struct neuron_device *nd, void *param)
 	return 0;
 }
 
-static int ncdev_mem_get_pa(void *param)
+static int ncdev_mem_get_pa(struct ncdev_file *f, void *param)
 {
 	struct neuron_ioctl_mem_get_pa mem_get_pa_arg;
 	struct mem_chunk *mc;
@@ -318,7 +460,9 @@ static int ncdev_mem_get_pa(void *param)
 	if (ret)
 		return ret;
 
-	mc = ncdev_mem_handle_to_mem_chunk(mem_get_pa_arg.mem_handle);
+	mc = ncdev_mem_handle_to_mem_chunk(f, mem_get_pa_arg.mem_handle);
+	if (mc == NULL)
+		return -EINVAL;
 	if (mc->mem_location == MEM_LOC_HOST)
 		pa = mc->pa | PCIEX8_0_BASE;
 	else
@@ -330,7 +474,131 @@ static int ncdev_mem_get_pa(void *param)
 	return copy_to_user(mem_get_pa_arg.pa, &pa, sizeof(u64));
 }
 
-static int ncdev_mem_free(struct neuron_device *nd, void *param)
+static int ncdev_mem_compact_copy(void *data, struct mem_chunk *mc, u64 src, u64 dst, u32 size)
+{
+	struct neuron_device *nd = data;
+
+	return ndma_memcpy(nd, mc->nc_id, src, dst, size);
+}
+
+static int ncdev_mem_compact(struct neuron_device *nd, void *param)
+{
+	struct neuron_ioctl_mem_compact arg;
+	int ret;
+
+	ret = copy_from_user(&arg, param, sizeof(arg));
+	if (ret)
+		return -EACCES;
+	if (arg.reserved)
+		return -EINVAL;
+	ret = mpset_compact(&nd->mpset, arg.dram_channel, arg.dram_region, ncdev_mem_compact_copy,
+			    nd, &arg.moved_count, &arg.moved_size);
+	// report partial progress even on failure, moved chunks already have a new pa
+	arg.generation = atomic64_read(&nd->mpset.device_generation);
+	if (copy_to_user(param, &arg, sizeof(arg)))
+		return -EACCES;
+	return ret;
+}
+
+/**
+ * ncdev_mem_handle_mmap_key() - Returns the key of a handle in its mmap() offset.
+ *
+ * The offset has room for MC_MMAP_KEY_BITS, the index is kept whole and the generation is cut.
+ */
+static u64 ncdev_mem_handle_mmap_key(u64 mh)
+{
+	u64 gen = (mh >> 32) & ((1ULL << (MC_MMAP_KEY_BITS - 32)) - 1);
+
+	return (gen << 32) | (u32)mh;
+}
+
+/**
+ * ncdev_mmap_lookup() - mc_lookup_fn_t which finds a host chunk by the key of its handle.
+ *
+ * Runs under mmap_lock, which page faults under f->mem_lock also take, so the chunk is looked up
+ * under the xarray lock instead. A handle is removed before its chunk is freed, and freeing a host
+ * chunk waits for the mpset->host_lock held by the caller, so a chunk found here stays valid.
+ */
+static struct mem_chunk *ncdev_mmap_lookup(void *data, u64 key)
+{
+	struct ncdev_file *f = data;
+	u32 gen_mask = (1U << (MC_MMAP_KEY_BITS - 32)) - 1;
+	struct mem_chunk *mc;
+
+	xa_lock(&f->mem_handles);
+	mc = xa_load(&f->mem_handles, (u32)key);
+	if (mc && ((mc->handle_gen & gen_mask) != (key >> 32) || mc->mem_location != MEM_LOC_HOST))
+		mc = NULL;
+	xa_unlock(&f->mem_handles);
+	return mc;
+}
+
+static int ncdev_mem_get_mmap_offset(struct ncdev_file *f, void *param)
+{
+	struct neuron_ioctl_mem_get_mmap_offset arg;
+	struct mem_chunk *mc;
+	int ret;
+
+	ret = copy_from_user(&arg, param, sizeof(arg));
+	if (ret)
+		return ret;
+
+	mc = ncdev_mem_handle_to_mem_chunk(f, arg.mem_handle);
+	if (mc == NULL)
+		return -EINVAL;
+	ret = mc_get_mmap_offset(mc, ncdev_mem_handle_mmap_key(arg.mem_handle), &arg.mmap_offset);
+	if (ret)
+		return ret;
+	return copy_to_user(&((struct neuron_ioctl_mem_get_mmap_offset *)param)->mmap_offset,
+			    &arg.mmap_offset, sizeof(arg.mmap_offset));
+}
+
+static u64 ncdev_mem_chunk_pa(struct mem_chunk *mc)
+{
+	if (mc->mem_location == MEM_LOC_HOST)
+		return mc->pa | PCIEX8_0_BASE;
+	return mc->pa;
+}
+
+static int ncdev_mem_get_segments(struct ncdev_file *f, void *param)
+{
+	struct neuron_ioctl_mem_get_segments arg;
+	struct neuron_ioctl_mem_segment seg;
+	struct mem_chunk *mc;
+	u32 i, count;
+	int ret;
+
+	ret = copy_from_user(&arg, param, sizeof(arg));
+	if (ret)
+		return ret;
+
+	if (arg.reserved)
+		return -EINVAL;
+	mc = ncdev_mem_handle_to_mem_chunk(f, arg.mem_handle);
+	if (mc == NULL)
+		return -EINVAL;
+	if (mc->sg == NULL) {
+		count = 1;
+		if (arg.count) {
+			seg.pa = ncdev_mem_chunk_pa(mc);
+			seg.size = mc->size;
+			if (copy_to_user(arg.segments, &seg, sizeof(seg)))
+				return -EFAULT;
+		}
+	} else {
+		count = mc->sg->nr_ranges;
+		for (i = 0; i < min(count, arg.count); i++) {
+			seg.pa = mc->sg->ranges[i].pa | PCIEX8_0_BASE;
+			seg.size = mc->sg->ranges[i].size;
+			if (copy_to_user(&arg.segments[i], &seg, sizeof(seg)))
+				return -EFAULT;
+		}
+	}
+	return copy_to_user(&((struct neuron_ioctl_mem_get_segments *)param)->count, &count,
+			    sizeof(count));
+}
+
+static int ncdev_mem_free(struct neuron_device *nd, struct ncdev_file *f, void *param)
 {
 	struct neuron_ioctl_mem_free mem_free_arg;
 	struct mem_chunk *mc;
@@ -340,13 +608,325 @@ static int ncdev_mem_free(struct neuron_device *nd, void *param)
 			     sizeof(mem_free_arg));
 	if (ret)
 		return ret;
-	mc = ncdev_mem_handle_to_mem_chunk(mem_free_arg.mem_handle);
+	mc = ncdev_mem_handle_remove(f, mem_free_arg.mem_handle);
+	if (mc == NULL)
+		return -EINVAL;
+	trace_ioctl_mem_alloc(nd, mc);
+	mc_free(&mc);
+	return 0;
+}
+
+static int ncdev_mem_reg_cmp(u64 addr, u64 size, struct ncdev_mem_reg *reg)
+{
+	if (addr != reg->addr)
+		return addr < reg->addr ? -1 : 1;
+	if (size != reg->size)
+		return size < reg->size ? -1 : 1;
+	return 0;
+}
+
+/**
+ * ncdev_mem_reg_find() - Find the registration of the buffer.
+ * Caller must hold f->mem_reg_lock.
+ *
+ * @f: file the buffer is registered through
+ * @addr: user address of the buffer
+ * @size: size of the buffer
+ * @link: if not NULL and the buffer is not registered, set to where its entry should be linked
+ * @parent: parent node for @link
+ *
+ * Return: the registration or NULL.
+ */
+static struct ncdev_mem_reg *ncdev_mem_reg_find(struct ncdev_file *f, u64 addr, u64 size,
+						struct rb_node ***link, struct rb_node **parent)
+{
+	struct rb_node **p = &f->mem_regs.rb_node;
+	struct rb_node *prev = NULL;
+
+	while (*p) {
+		struct ncdev_mem_reg *reg = rb_entry(*p, struct ncdev_mem_reg, node);
+		int cmp = ncdev_mem_reg_cmp(addr, size, reg);
+
+		if (cmp == 0)
+			return reg;
+		prev = *p;
+		p = cmp < 0 ? &(*p)->rb_left : &(*p)->rb_right;
+	}
+	if (link) {
+		*link = p;
+		*parent = prev;
+	}
+	return NULL;
+}
+
+static int ncdev_mem_register(struct neuron_device *nd, struct ncdev_file *f, void *param)
+{
+	struct neuron_ioctl_mem_register arg;
+	struct rb_node **link, *parent;
+	struct ncdev_mem_reg *reg;
+	struct mem_chunk *mc;
+	int ret;
+
+	if (copy_from_user(&arg, param, sizeof(arg)))
+		return -EACCES;
+	if (arg.size == 0 || arg.size > U32_MAX || arg.reserved)
+		return -EINVAL;
+
+	// held while pinning, so concurrent registrations of a buffer pin it only once
+	mutex_lock(&f->mem_reg_lock);
+	reg = ncdev_mem_reg_find(f, arg.addr, arg.size, &link, &parent);
+	if (reg) {
+		// the buffer might have been unmapped and the address reused since it was pinned
+		down_read(&f->mem_lock);
+		ret = mc_user_check(ncdev_mem_handle_to_mem_chunk(f, reg->mem_handle));
+		up_read(&f->mem_lock);
+		if (ret == 0)
+			ret = copy_to_user(arg.mem_handle, &reg->mem_handle, sizeof(reg->mem_handle));
+		if (ret == 0)
+			reg->refs++;
+		goto done;
+	}
+
+	reg = kzalloc(sizeof(*reg), GFP_KERNEL);
+	if (reg == NULL) {
+		ret = -ENOMEM;
+		goto done;
+	}
+	ret = mc_register_user(&nd->mpset, &mc, arg.addr, arg.size, arg.nc_id);
+	if (ret)
+		goto fail_reg;
+	trace_ioctl_mem_alloc(nd, mc);
+	ret = ncdev_mem_handle_create(f, mc, &reg->mem_handle);
+	if (ret)
+		goto fail_mc;
+	ret = copy_to_user(arg.mem_handle, &reg->mem_handle, sizeof(reg->mem_handle));
+	if (ret) {
+		__ncdev_mem_handle_remove(f, reg->mem_handle, true);
+		goto fail_mc;
+	}
+	reg->addr = arg.addr;
+	reg->size = arg.size;
+	reg->refs = 1;
+	rb_link_node(&reg->node, parent, link);
+	rb_insert_color(&reg->node, &f->mem_regs);
+	goto done;
+
+fail_mc:
+	mc_free(&mc);
+fail_reg:
+	kfree(reg);
+done:
+	mutex_unlock(&f->mem_reg_lock);
+	return ret;
+}
+
+static int ncdev_mem_deregister(struct neuron_device *nd, struct ncdev_file *f, void *param)
+{
+	struct neuron_ioctl_mem_deregister arg;
+	struct ncdev_mem_reg *reg = NULL;
+	struct mem_chunk *mc;
+	int ret = 0;
+
+	if (copy_from_user(&arg, param, sizeof(arg)))
+		return -EACCES;
+
+	mutex_lock(&f->mem_reg_lock);
+	down_read(&f->mem_lock);
+	mc = ncdev_mem_handle_to_mem_chunk(f, arg.mem_handle);
+	if (mc && (mc->alloc_flags & MC_ALLOC_USER))
+		reg = ncdev_mem_reg_find(f, mc->sg->user_addr, mc->size, NULL, NULL);
+	up_read(&f->mem_lock);
+	if (reg == NULL) {
+		ret = -EINVAL;
+		goto done;
+	}
+	if (--reg->refs)
+		goto done;
+	rb_erase(&reg->node, &f->mem_regs);
+	kfree(reg);
+	mc = __ncdev_mem_handle_remove(f, arg.mem_handle, true);
 	trace_ioctl_mem_alloc(nd, mc);
 	mc_free(&mc);
+done:
+	mutex_unlock(&f->mem_reg_lock);
+	return ret;
+}
+
+/**
+ * ncdev_mem_regs_free() - Drop the registration entries of the file.
+ *
+ * The registered chunks are in mem_handles and are freed along with the rest of its memory.
+ */
+static void ncdev_mem_regs_free(struct ncdev_file *f)
+{
+	struct ncdev_mem_reg *reg, *next;
+
+	rbtree_postorder_for_each_entry_safe (reg, next, &f->mem_regs, node)
+		kfree(reg);
+	f->mem_regs = RB_ROOT;
+}
+
+static int ncdev_mem_alloc_batch(struct neuron_device *nd, struct ncdev_file *f, void *param)
+{
+	struct neuron_ioctl_mem_alloc_batch arg;
+	struct neuron_ioctl_mem_alloc_entry *entries = NULL;
+	struct mc_alloc_request *reqs = NULL;
+	u32 i;
+	int ret;
+
+	ret = copy_from_user(&arg, param, sizeof(arg));
+	if (ret)
+		return -EACCES;
+	if (arg.count == 0)
+		return 0;
+	if (arg.count > NEURON_IOCTL_MEM_BATCH_MAX)
+		return -EINVAL;
+
+	entries = kmalloc_array(arg.count, sizeof(*entries), GFP_KERNEL);
+	reqs = kcalloc(arg.count, sizeof(*reqs), GFP_KERNEL);
+	if (entries == NULL || reqs == NULL) {
+		ret = -ENOMEM;
+		goto done;
+	}
+	if (copy_from_user(entries, arg.entries, arg.count * sizeof(*entries))) {
+		ret = -EACCES;
+		goto done;
+	}
+	for (i = 0; i < arg.count; i++) {
+		if (entries[i].size == 0 || entries[i].size > U32_MAX ||
+		    (entries[i].flags &
+		     ~(NEURON_MEM_ALLOC_FLAG_HUGE_PAGE | NEURON_MEM_ALLOC_FLAG_RELOCATABLE |
+		       NEURON_MEM_ALLOC_FLAG_NO_ZERO | NEURON_MEM_ALLOC_FLAG_AUTO_PLACEMENT |
+		       NEURON_MEM_ALLOC_FLAG_SCATTER_GATHER)) ||
+		    entries[i].reserved) {
+			ret = -EINVAL;
+			goto done;
+		}
+		if (entries[i].flags & NEURON_MEM_ALLOC_FLAG_HUGE_PAGE) {
+			if (entries[i].size > mc_huge_max_size()) {
+				pr_err_ratelimited("huge page allocation of %llu bytes exceeds max %u\n",
+						   entries[i].size, mc_huge_max_size());
+				ret = -E2BIG;
+				goto done;
+			}
+			reqs[i].flags |= MC_ALLOC_HUGE;
+		}
+		if (entries[i].flags & NEURON_MEM_ALLOC_FLAG_RELOCATABLE)
+			reqs[i].flags |= MC_ALLOC_RELOCATABLE;
+		if (entries[i].flags & NEURON_MEM_ALLOC_FLAG_NO_ZERO)
+			reqs[i].flags |= MC_ALLOC_NO_ZERO;
+		if (entries[i].flags & NEURON_MEM_ALLOC_FLAG_AUTO_PLACEMENT)
+			reqs[i].flags |= MC_ALLOC_AUTO_PLACE;
+		if (entries[i].flags & NEURON_MEM_ALLOC_FLAG_SCATTER_GATHER)
+			reqs[i].flags |= MC_ALLOC_SG;
+		reqs[i].size = entries[i].size;
+		reqs[i].location = entries[i].host_memory ? MEM_LOC_HOST : MEM_LOC_DEVICE;
+		reqs[i].channel = entries[i].dram_channel;
+		reqs[i].region = entries[i].dram_region;
+		reqs[i].nc_id = entries[i].nc_id;
+	}
+
+	ret = mc_alloc_batch(&nd->mpset, reqs, arg.count);
+	if (ret)
+		goto done;
+
+	for (i = 0; i < arg.count; i++) {
+		struct mem_chunk *mc = reqs[i].mc;
+
+		trace_ioctl_mem_alloc(nd, mc);
+		ret = ncdev_mem_handle_create(f, mc, &entries[i].mem_handle);
+		if (ret)
+			break;
+		entries[i].dram_channel = mc->dram_channel;
+		entries[i].dram_region = mc->dram_region;
+		entries[i].pa = ncdev_mem_chunk_pa(mc);
+	}
+	if (!ret && copy_to_user(arg.entries, entries, arg.count * sizeof(*entries)))
+		ret = -EACCES;
+	if (ret) {
+		u32 created = i;
+		struct mem_chunk **mcs = (struct mem_chunk **)entries;
+
+		for (i = 0; i < created; i++)
+			ncdev_mem_handle_remove(f, entries[i].mem_handle);
+		// entries is no longer needed, reuse it as the chunk array
+		for (i = 0; i < arg.count; i++)
+			mcs[i] = reqs[i].mc;
+		mc_free_batch(mcs, arg.count);
+	}
+
+done:
+	kfree(reqs);
+	kfree(entries);
+	return ret;
+}
+
+// sort() comparator, orders memory handles by value
+static int ncdev_mem_handle_cmp(const void *a, const void *b)
+{
+	u64 mha = *(const u64 *)a;
+	u64 mhb = *(const u64 *)b;
+
+	if (mha == mhb)
+		return 0;
+	return mha < mhb ? -1 : 1;
+}
+
+static int ncdev_mem_free_batch(struct neuron_device *nd, struct ncdev_file *f, void *param)
+{
+	struct neuron_ioctl_mem_free_batch arg;
+	struct mem_chunk **mcs;
+	u64 *handles;
+	u32 i;
+	int ret;
+
+	ret = copy_from_user(&arg, param, sizeof(arg));
+	if (ret)
+		return -EACCES;
+	if (arg.count == 0)
+		return 0;
+	if (arg.count > NEURON_IOCTL_MEM_BATCH_MAX)
+		return -EINVAL;
+
+	handles = kmalloc_array(arg.count, sizeof(*handles), GFP_KERNEL);
+	if (handles == NULL)
+		return -ENOMEM;
+	if (copy_from_user(handles, arg.mem_handles, arg.count * sizeof(*handles))) {
+		kfree(handles);
+		return -EACCES;
+	}
+
+	// duplicates end up next to each other
+	sort(handles, arg.count, sizeof(*handles), ncdev_mem_handle_cmp, NULL);
+
+	// either all the handles are removed or none
+	down_write(&f->mem_lock);
+	for (i = 0; i < arg.count; i++) {
+		struct mem_chunk *mc = ncdev_mem_handle_to_mem_chunk(f, handles[i]);
+
+		if (mc == NULL || (mc->alloc_flags & MC_ALLOC_USER) ||
+		    (i > 0 && handles[i] == handles[i - 1])) {
+			up_write(&f->mem_lock);
+			kfree(handles);
+			return -EINVAL;
+		}
+	}
+	// handles and chunk pointers have the same size, convert in place
+	BUILD_BUG_ON(sizeof(*handles) < sizeof(*mcs));
+	mcs = (struct mem_chunk **)handles;
+	for (i = 0; i < arg.count; i++)
+		mcs[i] = xa_erase(&f->mem_handles, (u32)handles[i]);
+	up_write(&f->mem_lock);
+
+	for (i = 0; i < arg.count; i++)
+		trace_ioctl_mem_alloc(nd, mcs[i]);
+	mc_free_batch(mcs, arg.count);
+
+	kfree(handles);
 	return 0;
 }
 
-static int ncdev_mem_copy(struct neuron_device *nd, void *param)
+static int ncdev_mem_copy(struct neuron_device *nd, struct ncdev_file *f, void *param)
 {
 	struct neuron_ioctl_mem_copy arg;
 	struct mem_chunk *src_mc;
@@ -356,8 +936,10 @@ static int ncdev_mem_copy(struct neuron_device *nd, void *param)
 	ret = copy_from_user(&arg, (struct neuron_ioctl_mem_copy *)param, sizeof(arg));
 	if (ret)
 		return ret;
-	src_mc = ncdev_mem_handle_to_mem_chunk(arg.src_mem_handle);
-	dst_mc = ncdev_mem_handle_to_mem_chunk(arg.dst_mem_handle);
+	src_mc = ncdev_mem_handle_to_mem_chunk(f, arg.src_mem_handle);
+	dst_mc = ncdev_mem_handle_to_mem_chunk(f, arg.dst_mem_handle);
+	if (src_mc == NULL || dst_mc == NULL)
+		return -EINVAL;
 	// check access is within the range.
 	if (arg.src_offset + arg.size > src_mc->size) {
 		pr_err("src offset+size is too large for mem handle\n");
@@ -377,7 +959,117 @@ static int ncdev_mem_copy(struct neuron_device *nd, void *param)
 	return 0;
 }
 
-int ncdev_mem_buf_copy(struct neuron_device *nd, void *param)
+// Bounds of the MEM_BUF_COPY staging parameters, the descriptors of all the staging buffers in
+// flight must fit in the H2T ring and a chunk must fit in a buffer of the device's staging pool.
+#define NCDEV_BUF_COPY_MAX_DEPTH 32
+#define NCDEV_BUF_COPY_MIN_CHUNK_KB 4
+#define NCDEV_BUF_COPY_MAX_CHUNK_KB (NDMA_STAGING_BUF_SIZE / 1024)
+
+/* A host buffer a MEM_BUF_COPY stages user data in. */
+struct ncdev_staging_slot {
+	struct ndma_staging_buf *buf; // buffer borrowed from the device's staging pool
+	struct ndma_copy copy; // DMA to or from the buffer, while in flight
+	u32 offset; // offset in the copy of the data in the buffer
+	u32 size; // size of the data in the buffer
+};
+
+/**
+ * ncdev_mem_buf_copy_staged() - Copy between a user buffer and device memory through a ring of
+ * host staging buffers.
+ *
+ * Up to ncdev_buf_copy_depth DMAs are in flight, the user copy of one staging buffer runs while
+ * the device transfers the others.
+ */
+static int ncdev_mem_buf_copy_staged(struct neuron_device *nd, struct mem_chunk *mc,
+				     struct neuron_ioctl_mem_buf_copy *arg)
+{
+	u32 chunk = clamp(READ_ONCE(ncdev_buf_copy_chunk_kb), NCDEV_BUF_COPY_MIN_CHUNK_KB,
+			  NCDEV_BUF_COPY_MAX_CHUNK_KB) * 1024;
+	u32 depth = clamp(READ_ONCE(ncdev_buf_copy_depth), 1, NCDEV_BUF_COPY_MAX_DEPTH);
+	dma_addr_t dev_addr = mc->pa + arg->offset;
+	struct ncdev_staging_slot *slots, *slot;
+	u32 submitted = 0, done = 0; // bytes started and completed
+	u32 head = 0, tail = 0; // next buffer to start and to complete
+	u32 i, count;
+	struct ndma_eng *eng;
+	int ret, err;
+
+	if (arg->size == 0)
+		return 0;
+	// a copy never borrows more buffers than it has chunks
+	chunk = min(chunk, arg->size);
+	count = min_t(u32, depth, DIV_ROUND_UP(arg->size, chunk));
+	slots = kcalloc(count, sizeof(*slots), GFP_KERNEL);
+	if (slots == NULL)
+		return -ENOMEM;
+	for (i = 0; i < count; i++) {
+		ret = ndmar_staging_get(nd, chunk, mc->nc_id, &slots[i].buf);
+		if (ret)
+			goto put_bufs;
+		slots[i].copy.marker = slots[i].buf->marker;
+		slots[i].copy.marker_addr = slots[i].buf->marker_addr;
+	}
+
+	mc_account_dma(mc, arg->size);
+	eng = ndma_h2t_lock(nd, mc->nc_id);
+	while (done < arg->size) {
+		// start as many buffers as are free
+		while (submitted < arg->size && head - tail < count) {
+			dma_addr_t host_addr;
+
+			slot = &slots[head % count];
+			host_addr = slot->buf->mc->pa | PCIEX8_0_BASE;
+			slot->offset = submitted;
+			slot->size = min(chunk, arg->size - submitted);
+			if (arg->copy_to_mem_handle) {
+				if (copy_from_user(slot->buf->mc->va, arg->buffer + slot->offset,
+						   slot->size)) {
+					ret = -EFAULT;
+					goto drain;
+				}
+				ret = ndma_memcpy_start(eng, host_addr, dev_addr + slot->offset,
+							slot->size, &slot->copy);
+			} else {
+				ret = ndma_memcpy_start(eng, dev_addr + slot->offset, host_addr,
+							slot->size, &slot->copy);
+			}
+			if (ret)
+				goto drain;
+			submitted += slot->size;
+			head++;
+		}
+		// complete the oldest one, the others stay in flight meanwhile
+		slot = &slots[tail % count];
+		ret = ndma_memcpy_wait(eng, &slot->copy);
+		if (ret)
+			goto drain;
+		tail++;
+		if (!arg->copy_to_mem_handle &&
+		    copy_to_user(arg->buffer + slot->offset, slot->buf->mc->va, slot->size)) {
+			ret = -EFAULT;
+			goto drain;
+		}
+		done += slot->size;
+	}
+
+drain:
+	// the staging buffers can not be freed while the device might still write to them
+	for (; tail != head; tail++) {
+		err = ndma_memcpy_wait(eng, &slots[tail % count].copy);
+		if (err)
+			ret = ret ?: err;
+	}
+	ndma_h2t_unlock(eng);
+put_bufs:
+	for (i = 0; i < count; i++) {
+		if (slots[i].buf)
+			ndmar_staging_put(nd, slots[i].buf);
+	}
+	kfree(slots);
+	return ret;
+}
+
+static int ncdev_mem_buf_copy(struct neuron_device *nd, struct ncdev_file *f, void *param)
 {
 	struct neuron_ioctl_mem_buf_copy arg;
 	struct mem_chunk *mc;
@@ -386,7 +1078,9 @@ int ncdev_mem_buf_copy(struct neuron_device *nd, void *param)
 	ret = copy_from_user(&arg, (struct neuron_ioctl_mem_buf_copy *)param, sizeof(arg));
 	if (ret)
 		return ret;
-	mc = ncdev_mem_handle_to_mem_chunk(arg.mem_handle);
+	mc = ncdev_mem_handle_to_mem_chunk(f, arg.mem_handle);
+	if (mc == NULL)
+		return -EINVAL;
 	// check access is within the range.
 	if (arg.offset + arg.size > mc->size) {
 		pr_err("offset+size is too large for mem handle\n");
@@ -405,47 +1099,8 @@ int ncdev_mem_buf_copy(struct neuron_device *nd, void *param)
 			ret = copy_to_user(arg.buffer, mc->va + arg.offset, arg.size);
 		}
 		return ret;
-	} else {
-		// TODO - this has to be converted to mmap
-		struct mem_chunk *src_mc;
-		u32 offset = 0;
-		int remaining = arg.size;
-		u32 copy_size = 0;
-		ret = mc_alloc(&nd->mpset, &src_mc, MAX_DMA_DESC_SIZE, MEM_LOC_HOST, 0, 0,
-			       mc->nc_id);
-		if (ret) {
-			ret = -ENOMEM;
-			return ret;
-		}
-		while (remaining) {
-			copy_size = remaining < MAX_DMA_DESC_SIZE ? remaining : MAX_DMA_DESC_SIZE;
-			if (arg.copy_to_mem_handle) {
-				ret = copy_from_user(src_mc->va, arg.buffer + offset, copy_size);
-				if (ret) {
-					break;
-				}
-				ret = ndma_memcpy_buf_to_mc(nd, src_mc->va, 0, mc,
-							    arg.offset + offset, copy_size);
-				if (ret) {
-					break;
-				}
-			} else {
-				ret = ndma_memcpy_buf_from_mc(nd, src_mc->va, 0, mc,
-							      arg.offset + offset, copy_size);
-				if (ret) {
-					break;
-				}
-				ret = copy_to_user(arg.buffer + offset, src_mc->va, copy_size);
-				if (ret) {
-					break;
-				}
-			}
-			remaining -= copy_size;
-			offset += copy_size;
-		}
-		mc_free(&src_mc);
-		return ret;
 	}
+	return ncdev_mem_buf_copy_staged(nd, mc, &arg);
 }
 
 static long ncdev_semaphore_ioctl(struct neuron_device *nd, unsigned int cmd, void *param)
@@ -511,21 +1166,21 @@ static long ncdev_bar_read(struct neuron_device *nd, u8 bar, u64 *reg_addresses,
 		ret = copy_to_user(user_va, data, data_size);
 		kfree(data);
 	} else {
-		struct mem_chunk *mc;
+		struct ndma_staging_buf *buf;
 		u32 nc_id = 0;
 		dma_addr_t src_addr = reg_addresses[0];
 
-		ret = mc_alloc(&nd->mpset, &mc, data_size, MEM_LOC_HOST, 0, 0, nc_id);
+		ret = ndmar_staging_get(nd, data_size, nc_id, &buf);
 		if (ret)
 			return -ENOMEM;
 
-		ret = ndma_memcpy(nd, mc->nc_id, src_addr, mc->pa | PCIEX8_0_BASE, data_size);
+		ret = ndma_memcpy(nd, nc_id, src_addr, buf->mc->pa | PCIEX8_0_BASE, data_size);
 		if (ret) {
-			mc_free(&mc);
+			ndmar_staging_put(nd, buf);
 			return ret;
 		}
-		ret = copy_to_user(user_va, mc->va, data_size);
-		mc_free(&mc);
+		ret = copy_to_user(user_va, buf->mc->va, data_size);
+		ndmar_staging_put(nd, buf);
 	}
 	return ret;
 }
@@ -752,15 +1407,23 @@ static long ncdev_device_init(struct neuron_device *nd, void *param)
 	u64 device_dram_addr[V1_MAX_DRAM_CHANNELS] = { P_0_DRAM_0_BASE, P_0_DRAM_1_BASE };
 	u64 device_dram_size[V1_MAX_DRAM_CHANNELS] = { P_0_DRAM_0_SIZE, P_0_DRAM_1_SIZE };
 
+	// fence: the previous owner's memory must be freed before the pools are reinitialized. The
+	// caller has the device open, so no teardown can be queued after this.
+	flush_work(&nd->teardown_work);
+
 	mutex_lock(&ncdev_device_lock);
 	ret = copy_from_user(&arg, (struct neuron_ioctl_device_init *)param, sizeof(arg));
 	if (ret) {
+		mutex_unlock(&ncdev_device_lock);
 		return ret;
 	}
 
 	if (nd->current_pid == 0) {
 		ret = mpset_device_init(&nd->mpset, V1_MAX_DRAM_CHANNELS, arg.mem_regions,
-					device_dram_addr, device_dram_size);
+					device_dram_addr, device_dram_size,
+					mempool_device_allocator == MEMPOOL_ALLOCATOR_BUDDY ?
+						MEMPOOL_ALLOCATOR_BUDDY :
+						MEMPOOL_ALLOCATOR_GENPOOL);
 		if (ret)
 			goto done;
 		nd->current_pid = task_tgid_nr(current);
@@ -776,24 +1439,44 @@ done:
 	return ret;
 }
 
-static long ncdev_device_release(struct ncdev *dev, struct neuron_device *nd)
+/**
+ * ncdev_device_teardown() - Free all the memory of the previous owner of the device.
+ *
+ * Runs on the device's teardown workqueue after the hardware stopped using the memory.
+ */
+static void ncdev_device_teardown(struct work_struct *work)
 {
-	int ret = 0;
-	mutex_lock(&ncdev_device_lock);
+	struct neuron_device *nd = container_of(work, struct neuron_device, teardown_work);
+
+	nc_nq_free_all(nd);
+	mpset_free_all(&nd->mpset);
+	nd->mpset.num_regions = 0;
+}
 
+/**
+ * __ncdev_device_release() - Release ownership and tear the device down once nothing uses it.
+ * Caller must hold ncdev_device_lock.
+ */
+static void __ncdev_device_release(struct ncdev *dev, struct neuron_device *nd)
+{
 	if ((nd->current_pid_open_count == 0) && ((nd->current_pid == task_tgid_nr(current)) || nd->current_pid == task_ppid_nr(current))) {
 		nd->current_pid = 0;
 	}
 
-	if (dev->open_count == 0) {
-		nc_nq_destroy_all(nd);
+	if (dev->open_count == 0 && dev->closing == 0) {
+		// quiesce the hardware here, the memory is freed in the background
+		nc_nq_disable_all(nd);
 		ndmar_close(nd);
-		mpset_free_all(&nd->mpset);
-		nd->mpset.num_regions = 0;
+		queue_work(nd->teardown_wq, &nd->teardown_work);
 	}
+}
 
+static long ncdev_device_release(struct ncdev *dev, struct neuron_device *nd)
+{
+	mutex_lock(&ncdev_device_lock);
+	__ncdev_device_release(dev, nd);
 	mutex_unlock(&ncdev_device_lock);
-	return ret;
+	return 0;
 }
 
 static long ncdev_device_app_pid(struct neuron_device *nd, void *param)
@@ -840,15 +1523,53 @@ static long ncdev_nc_nq_destroy(struct neuron_device *nd, void *param)
 	return nc_nq_destroy(nd, nc_id, eng_index, nq_type);
 }
 
+/**
+ * ncdev_ioctl_mem_use() - Run an ioctl which uses chunks looked up by handle.
+ *
+ * The chunks can neither be freed nor moved by compaction until the ioctl returns.
+ *
+ * Return: the result of the ioctl.
+ */
+static long ncdev_ioctl_mem_use(struct neuron_device *nd, struct ncdev_file *f, unsigned int cmd,
+				unsigned long param)
+{
+	long ret;
+
+	down_read(&f->mem_lock);
+	mpset_relocate_lock(&nd->mpset);
+	if (cmd == NEURON_IOCTL_DMA_QUEUE_INIT) {
+		ret = ncdev_dma_queue_init(nd, f, (void *)param);
+	} else if (cmd == NEURON_IOCTL_DMA_COPY_DESCRIPTORS) {
+		ret = ncdev_dma_copy_descriptors(nd, f, (void *)param);
+	} else if (cmd == NEURON_IOCTL_MEM_GET_PA) {
+		ret = ncdev_mem_get_pa(f, (void *)param);
+	} else if (cmd == NEURON_IOCTL_MEM_GET_MMAP_OFFSET) {
+		ret = ncdev_mem_get_mmap_offset(f, (void *)param);
+	} else if (cmd == NEURON_IOCTL_MEM_GET_SEGMENTS) {
+		ret = ncdev_mem_get_segments(f, (void *)param);
+	} else if (cmd == NEURON_IOCTL_MEM_COPY) {
+		ret = ncdev_mem_copy(nd, f, (void *)param);
+	} else if (cmd == NEURON_IOCTL_MEM_BUF_COPY) {
+		ret = ncdev_mem_buf_copy(nd, f, (void *)param);
+	} else {
+		ret = -EINVAL;
+	}
+	mpset_relocate_unlock(&nd->mpset);
+	up_read(&f->mem_lock);
+	return ret;
+}
+
 long ncdev_ioctl(struct file *filep, unsigned int cmd, unsigned long param)
 {
+	struct ncdev_file *f;
 	struct ncdev *ncd;
 	struct neuron_device *nd;
 
-	ncd = filep->private_data;
-	if (ncd == NULL) {
+	f = filep->private_data;
+	if (f == NULL) {
 		return -EINVAL;
 	}
+	ncd = f->ncd;
 	nd = ncd->ndev;
 	if (nd == NULL) {
 		return -EINVAL;
@@ -860,6 +1581,10 @@ long ncdev_ioctl(struct file *filep, unsigned int cmd, unsigned long param)
 	    cmd == NEURON_IOCTL_DMA_QUEUE_RELEASE || cmd == NEURON_IOCTL_DMA_COPY_DESCRIPTORS ||
 	    cmd == NEURON_IOCTL_MEM_ALLOC || cmd == NEURON_IOCTL_MEM_FREE ||
 	    cmd == NEURON_IOCTL_MEM_COPY || cmd == NEURON_IOCTL_MEM_GET_PA ||
+	    cmd == NEURON_IOCTL_MEM_ALLOC_BATCH || cmd == NEURON_IOCTL_MEM_FREE_BATCH ||
+	    cmd == NEURON_IOCTL_MEM_GET_MMAP_OFFSET || cmd == NEURON_IOCTL_MEM_COMPACT ||
+	    cmd == NEURON_IOCTL_MEM_GET_SEGMENTS || cmd == NEURON_IOCTL_MEM_REGISTER ||
+	    cmd == NEURON_IOCTL_MEM_DEREGISTER ||
 	    cmd == NEURON_IOCTL_BAR_WRITE || cmd == NEURON_IOCTL_POST_METRIC ||
 	    cmd == NEURON_IOCTL_NOTIFICATIONS_INIT || cmd == NEURON_IOCTL_NOTIFICATIONS_DESTROY) {
 		if (nd->current_pid != task_tgid_nr(current)) {
@@ -867,6 +1592,12 @@ long ncdev_ioctl(struct file *filep, unsigned int cmd, unsigned long param)
 		}
 	}
 
+	if (cmd == NEURON_IOCTL_DMA_QUEUE_INIT || cmd == NEURON_IOCTL_DMA_COPY_DESCRIPTORS ||
+	    cmd == NEURON_IOCTL_MEM_GET_PA || cmd == NEURON_IOCTL_MEM_GET_MMAP_OFFSET ||
+	    cmd == NEURON_IOCTL_MEM_GET_SEGMENTS || cmd == NEURON_IOCTL_MEM_COPY ||
+	    cmd == NEURON_IOCTL_MEM_BUF_COPY)
+		return ncdev_ioctl_mem_use(nd, f, cmd, param);
+
 	if (cmd == NEURON_IOCTL_DEVICE_RESET) {
 		return ncdev_device_reset(nd);
 	} else if (cmd == NEURON_IOCTL_DEVICE_RESET_STATUS) {
@@ -885,16 +1616,12 @@ long ncdev_ioctl(struct file *filep, unsigned int cmd, unsigned long param)
 		return ncdev_dma_engine_init(nd, (void *)param);
 	} else if (cmd == NEURON_IOCTL_DMA_ENG_SET_STATE) {
 		return ncdev_dma_engine_set_state(nd, (void *)param);
-	} else if (cmd == NEURON_IOCTL_DMA_QUEUE_INIT) {
-		return ncdev_dma_queue_init(nd, (void *)param);
 	} else if (cmd == NEURON_IOCTL_DMA_QUEUE_COPY_START) {
 		return ncdev_dma_copy_start(nd, (void *)param);
 	} else if (cmd == NEURON_IOCTL_DMA_ACK_COMPLETED) {
 		return ncdev_dma_ack_completed(nd, (void *)param);
 	} else if (cmd == NEURON_IOCTL_DMA_QUEUE_RELEASE) {
 		return ncdev_dma_queue_release(nd, (void *)param);
-	} else if (cmd == NEURON_IOCTL_DMA_COPY_DESCRIPTORS) {
-		return ncdev_dma_copy_descriptors(nd, (void *)param);
 	} else if (cmd == NEURON_IOCTL_DMA_ENG_GET_STATE) {
 		return ncdev_dma_engine_get_state(nd, (void *)param);
 	} else if (cmd == NEURON_IOCTL_DMA_QUEUE_GET_STATE) {
@@ -902,15 +1629,19 @@ long ncdev_ioctl(struct file *filep, unsigned int cmd, unsigned long param)
 	} else if (cmd == NEURON_IOCTL_DMA_DESCRIPTOR_COPYOUT) {
 		return ncdev_dma_descriptor_copyout(nd, (void *)param);
 	} else if (cmd == NEURON_IOCTL_MEM_ALLOC) {
-		return ncdev_mem_alloc(nd, (void *)param);
-	} else if (cmd == NEURON_IOCTL_MEM_GET_PA) {
-		return ncdev_mem_get_pa((void *)param);
+		return ncdev_mem_alloc(nd, f, (void *)param);
 	} else if (cmd == NEURON_IOCTL_MEM_FREE) {
-		return ncdev_mem_free(nd, (void *)param);
-	} else if (cmd == NEURON_IOCTL_MEM_COPY) {
-		return ncdev_mem_copy(nd, (void *)param);
-	} else if (cmd == NEURON_IOCTL_MEM_BUF_COPY) {
-		return ncdev_mem_buf_copy(nd, (void *)param);
+		return ncdev_mem_free(nd, f, (void *)param);
+	} else if (cmd == NEURON_IOCTL_MEM_ALLOC_BATCH) {
+		return ncdev_mem_alloc_batch(nd, f, (void *)param);
+	} else if (cmd == NEURON_IOCTL_MEM_FREE_BATCH) {
+		return ncdev_mem_free_batch(nd, f, (void *)param);
+	} else if (cmd == NEURON_IOCTL_MEM_COMPACT) {
+		return ncdev_mem_compact(nd, (void *)param);
+	} else if (cmd == NEURON_IOCTL_MEM_REGISTER) {
+		return ncdev_mem_register(nd, f, (void *)param);
+	} else if (cmd == NEURON_IOCTL_MEM_DEREGISTER) {
+		return ncdev_mem_deregister(nd, f, (void *)param);
 	} else if (cmd == NEURON_IOCTL_SEMAPHORE_READ) {
 		return ncdev_semaphore_ioctl(nd, cmd, (void *)param);
 	} else if (cmd == NEURON_IOCTL_SEMAPHORE_WRITE) {
@@ -944,6 +1675,7 @@ long ncdev_ioctl(struct file *filep, unsigned int cmd, unsigned long param)
 static int ncdev_open(struct inode *inode, struct file *filep)
 {
 	struct ncdev *dev;
+	struct ncdev_file *f;
 	struct neuron_device *nd;
 	dev = &devnodes[iminor(inode)];
 	nd = dev->ndev;
@@ -951,46 +1683,80 @@ static int ncdev_open(struct inode *inode, struct file *filep)
 		pr_err("unable to lock device\n");
 		return -ENODEV;
 	}
+	f = kzalloc(sizeof(*f), GFP_KERNEL);
+	if (f == NULL)
+		return -ENOMEM;
+	f->ncd = dev;
+	// index 0 is never used, so no handle is 0
+	xa_init_flags(&f->mem_handles, XA_FLAGS_ALLOC1);
+	init_rwsem(&f->mem_lock);
+	mutex_init(&f->mem_reg_lock);
+	f->mem_regs = RB_ROOT;
 	mutex_lock(&ncdev_device_lock);
 	dev->open_count++;
 	if (nd && (nd->current_pid == task_tgid_nr(current) || nd->current_pid == task_ppid_nr(current))) {
 		nd->current_pid_open_count++;
 	}
 	mutex_unlock(&ncdev_device_lock);
-	filep->private_data = dev;
+	filep->private_data = f;
 	return 0;
 }
 
 static int ncdev_close(struct inode *inode, struct file *filep)
 {
-	struct ncdev *dev = (struct ncdev *)filep->private_data;
+	struct ncdev_file *f = filep->private_data;
+	struct ncdev *dev = f->ncd;
 	struct neuron_device *nd = dev->ndev;
+	bool last;
+
 	mutex_lock(&ncdev_device_lock);
 	dev->open_count--;
+	last = dev->open_count == 0;
+	dev->closing++;
 	if (nd && (nd->current_pid == task_tgid_nr(current) || nd->current_pid == task_ppid_nr(current))) {
 		nd->current_pid_open_count--;
 	}
 	mutex_unlock(&ncdev_device_lock);
 
-	return ncdev_device_release(dev, nd);
+	ncdev_mem_regs_free(f);
+	// the last close leaves this file's memory to the device teardown, which frees the whole mpset.
+	// The teardown only starts when no close is in progress, so it never frees chunks another
+	// close is still freeing.
+	if (last)
+		xa_destroy(&f->mem_handles);
+	else
+		ncdev_mem_handles_free_all(f);
+	kfree(f);
+
+	mutex_lock(&ncdev_device_lock);
+	dev->closing--;
+	__ncdev_device_release(dev, nd);
+	mutex_unlock(&ncdev_device_lock);
+	return 0;
 }
 
 static int ncdev_mmap(struct file *filep, struct vm_area_struct *vma)
 {
-	struct ncdev *ncd;
+	struct ncdev_file *f;
 	struct neuron_device *nd;
 	int ret, nc_id, eng_index, nq_type;
 	u64 offset;
 
-	ncd = filep->private_data;
-	if (ncd == NULL) {
+	f = filep->private_data;
+	if (f == NULL) {
 		return -EINVAL;
 	}
-	nd = ncd->ndev;
+	nd = f->ncd->ndev;
 	if (nd == NULL) {
 		return -EINVAL;
 	}
 	offset = vma->vm_pgoff * PAGE_SIZE;
+	if (offset >= MC_MMAP_START_OFFSET) {
+		// host memory chunks can be mapped only by the process which owns the device
+		if (nd->current_pid != task_tgid_nr(current))
+			return -EACCES;
+		return mpset_mmap(&nd->mpset, offset, ncdev_mmap_lookup, f, vma);
+	}
 	ret = nc_get_nq_from_mmap_offset(offset, &nc_id, &eng_index, &nq_type);
 	if (ret) {
 		return ret;
@@ -1018,12 +1784,18 @@ int ncdev_create_device_node(struct neuron_device *ndev)
 
 	snprintf(dev_name, sizeof(dev_name), "neuron%d", ndev->device_index);
 
+	INIT_WORK(&ndev->teardown_work, ncdev_device_teardown);
+	ndev->teardown_wq = alloc_ordered_workqueue("%s_teardown", 0, dev_name);
+	if (ndev->teardown_wq == NULL)
+		return -ENOMEM;
+
 	minor = ndev->device_index;
 	devnodes[ndev->device_index].minor = minor;
 
 	devno = MKDEV(major, minor);
 	cdev = cdev_alloc();
 	if (cdev == NULL) {
+		destroy_workqueue(ndev->teardown_wq);
 		return -1;
 	}
 	cdev_init(cdev, &ncdev_fops);
@@ -1034,6 +1806,7 @@ int ncdev_create_device_node(struct neuron_device *ndev)
 	if (ret < 0) {
 		pr_err("failed to register character device %s\n", dev_name);
 		cdev_del(cdev);
+		destroy_workqueue(ndev->teardown_wq);
 		return -1;
 	}
 
@@ -1049,6 +1822,7 @@ int ncdev_create_device_node(struct neuron_device *ndev)
 		pr_err("error %d while trying to create %s\n", ret, dev_name);
 		device_destroy(neuron_dev_class, devno);
 		cdev_del(cdev);
+		destroy_workqueue(ndev->teardown_wq);
 		return ret;
 	}
 
@@ -1066,6 +1840,9 @@ int ncdev_delete_device_node(struct neuron_device *ndev)
 	device_destroy(neuron_dev_class, devno);
 	cdev_del(devnodes[minor].cdev);
 	memset(&devnodes[ndev->device_index], 0, sizeof(devnodes[0]));
+	// waits for a pending teardown, the mpset is destroyed after this
+	destroy_workqueue(ndev->teardown_wq);
+	ndev->teardown_wq = NULL;
 
 	return 0;
 }
@@ -219,7 +219,7 @@ int nc_nq_init(struct neuron_device *nd, u8 nc_id, u8 eng_index, u32 nq_type, u3
 
 	mc_ptr = &nd->nq_mc[nc_id][nq_id];
 	if (*mc_ptr == NULL) {
-		ret = mc_alloc(&nd->mpset, mc_ptr, size, MEM_LOC_HOST, 0, 0, nc_id);
+		ret = mc_alloc(&nd->mpset, mc_ptr, size, MEM_LOC_HOST, 0, 0, nc_id, MC_ALLOC_INTERNAL);
 		if (ret)
 			return ret;
 	}
@@ -258,7 +258,12 @@ int nc_nq_init(struct neuron_device *nd, u8 nc_id, u8 eng_index, u32 nq_type, u3
 	return 0;
 }
 
-int nc_nq_destroy(struct neuron_device *nd, u8 nc_id, u8 eng_index, u32 nq_type)
+/**
+ * nc_nq_disable() - Stop the hardware from writing to the notification queue.
+ *
+ * Return: 1 if the queue was disabled, 0 if it was not initialized, a negative error code otherwise.
+ */
+static int nc_nq_disable(struct neuron_device *nd, u8 nc_id, u8 eng_index, u32 nq_type)
 {
 	u8 nq_id;
 	void *apb_base;
@@ -266,12 +271,6 @@ int nc_nq_destroy(struct neuron_device *nd, u8 nc_id, u8 eng_index, u32 nq_type)
 	nq_id = (nq_type * NQ_TYPE_PER_ENGINE) + eng_index;
 	if (nd == NULL || nc_id >= V1_NC_PER_DEVICE || nq_id >= MAX_NQ_SUPPORTED)
 		return -EINVAL;
-	if (nd == NULL || nc_id >= V1_NC_PER_DEVICE)
-		return -EINVAL;
-
-	nq_id = (nq_type * NQ_TYPE_PER_ENGINE) + eng_index;
-	if (nq_id >= MAX_NQ_SUPPORTED)
-		return -EINVAL;
 
 	if (nd->nq_mc[nc_id][nq_id] == NULL) {
 		return 0;
@@ -302,27 +301,55 @@ int nc_nq_destroy(struct neuron_device *nd, u8 nc_id, u8 eng_index, u32 nq_type)
 	default:
 		return -1;
 	}
+	return 1;
+}
+
+int nc_nq_destroy(struct neuron_device *nd, u8 nc_id, u8 eng_index, u32 nq_type)
+{
+	int ret;
+
+	ret = nc_nq_disable(nd, nc_id, eng_index, nq_type);
+	if (ret <= 0)
+		return ret;
 
 	// sleep 1msec so that hw can drain
 	msleep(1);
 
-	mc_free(&nd->nq_mc[nc_id][nq_id]);
+	mc_free(&nd->nq_mc[nc_id][(nq_type * NQ_TYPE_PER_ENGINE) + eng_index]);
 	return 0;
 }
 
-void nc_nq_destroy_all(struct neuron_device *nd)
+void nc_nq_disable_all(struct neuron_device *nd)
 {
 	u8 nc_id;
 	u8 eng_index;
 	u8 nq_type;
+	bool disabled = false;
 
 	for (nc_id = 0; nc_id < V1_NC_PER_DEVICE; nc_id++) {
 		for (eng_index = 0; eng_index < MAX_NQ_ENGINE; eng_index++) {
 			for (nq_type = 0; nq_type < NQ_TYPE_PER_ENGINE; nq_type++) {
-				nc_nq_destroy(nd, nc_id, eng_index, nq_type);
+				if (nc_nq_disable(nd, nc_id, eng_index, nq_type) > 0)
+					disabled = true;
 			}
 		}
 	}
+	// one drain period covers all the queues disabled above
+	if (disabled)
+		msleep(1);
+}
+
+void nc_nq_free_all(struct neuron_device *nd)
+{
+	u8 nc_id;
+	u8 nq_id;
+
+	for (nc_id = 0; nc_id < V1_NC_PER_DEVICE; nc_id++) {
+		for (nq_id = 0; nq_id < MAX_NQ_SUPPORTED; nq_id++) {
+			if (nd->nq_mc[nc_id][nq_id])
+				mc_free(&nd->nq_mc[nc_id][nq_id]);
+		}
+	}
 }
 
 int nc_nq_mmap(struct neuron_device *nd, u8 nc_id, u8 eng_index, u32 nq_type,
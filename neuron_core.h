@@ -134,12 +134,22 @@ int nc_nq_init(struct neuron_device *nd, u8 nc_id, u8 eng_index, u32 nq_type, u3
 int nc_nq_destroy(struct neuron_device *nd, u8 nc_id, u8 eng_index, u32 nq_type);
 
 /**
- * nc_nq_destroy_all() - Disable notification in the device
+ * nc_nq_disable_all() - Disable notification in the device and wait for the hardware to drain.
+ *
+ * The queues' memory stays allocated until nc_nq_free_all().
+ *
+ * @nd: neuron device
+ *
+ */
+void nc_nq_disable_all(struct neuron_device *nd);
+
+/**
+ * nc_nq_free_all() - Free memory of all the notification queues disabled by nc_nq_disable_all().
  *
  * @nd: neuron device
  *
  */
-void nc_nq_destroy_all(struct neuron_device *nd);
+void nc_nq_free_all(struct neuron_device *nd);
 
 /**
  * nc_nq_mmap() - mmap the notification queue into process address space.
@@ -0,0 +1,179 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright 2020, Amazon.com, Inc. or its affiliates. All Rights Reserved
+ */
+
+/* Allocator introspection files of a neuron device in debugfs.
+ *
+ *  mempools          - usage and fragmentation of the host pool and each device pool
+ *  mempool_free_hist - free extent count of each power of 2 size starting at the pool's min alloc size
+ *  mempool_latency   - alloc and free latency histograms, bucket i counts [2^i, 2^(i + 1)) ns
+ *
+ * The host pool's free extents are those of the reserved host region, all zero if nothing is
+ * reserved. Counters are read without the pool locks, so a line can be slightly inconsistent.
+ */
+
+#include <linux/kernel.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/version.h>
+
+#include "neuron_device.h"
+#include "neuron_debugfs.h"
+
+struct dentry *neuron_dbgfs_root;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 16, 0)
+#define DEFINE_SHOW_ATTRIBUTE(__name)                                                              \
+	static int __name##_open(struct inode *inode, struct file *file)                           \
+	{                                                                                          \
+		return single_open(file, __name##_show, inode->i_private);                         \
+	}                                                                                          \
+	static const struct file_operations __name##_fops = {                                      \
+		.owner = THIS_MODULE,                                                              \
+		.open = __name##_open,                                                             \
+		.read = seq_read,                                                                  \
+		.llseek = seq_lseek,                                                               \
+		.release = single_release,                                                         \
+	}
+#endif
+
+static struct mempool *mpset_host_pool(struct mempool_set *mpset)
+{
+	return mpset->host_reserved_va ? &mpset->host_reserved : NULL;
+}
+
+static void neuron_dbgfs_show_pool(struct seq_file *s, const char *name, const char *allocator,
+				   u64 size, u64 allocated, u64 nr_chunks, struct mempool *mp)
+{
+	struct mempool_frag_stats stats;
+
+	memset(&stats, 0, sizeof(stats));
+	if (mp)
+		mp_get_frag_stats(mp, &stats);
+	seq_printf(s, "%s %s %llu %llu %llu %llu %llu %llu\n", name, allocator, size, allocated,
+		   nr_chunks, stats.free_size, stats.largest_free, stats.free_extents);
+}
+
+static int mempools_show(struct seq_file *s, void *unused)
+{
+	struct neuron_device *nd = s->private;
+	struct mempool_set *mpset = &nd->mpset;
+	struct mempool *host_mp = mpset_host_pool(mpset);
+	u32 channel, region;
+
+	seq_puts(s, "pool allocator size allocated chunks free largest_free free_extents\n");
+	neuron_dbgfs_show_pool(s, "host", host_mp ? host_mp->ops->name : "kmalloc",
+			       host_mp ? host_mp->region_size : 0,
+			       atomic64_read(&mpset->host_mem_size), READ_ONCE(mpset->host_nr_chunks),
+			       host_mp);
+	mutex_lock(&mpset->device_pools_lock);
+	for (channel = 0; channel < V1_MAX_DRAM_CHANNELS; channel++) {
+		for (region = 0; region < MAX_DDR_REGIONS; region++) {
+			struct mempool *mp = &mpset->mp_device[channel][region];
+			char name[16];
+
+			if (!mp->initialized)
+				continue;
+			snprintf(name, sizeof(name), "%u:%u", channel, region);
+			neuron_dbgfs_show_pool(s, name, mp->ops->name, mp->region_size,
+					       READ_ONCE(mp->allocated_size), READ_ONCE(mp->nr_chunks),
+					       mp);
+		}
+	}
+	mutex_unlock(&mpset->device_pools_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mempools);
+
+static void neuron_dbgfs_show_free_hist(struct seq_file *s, const char *name, struct mempool *mp)
+{
+	struct mempool_frag_stats stats;
+	int i;
+
+	mp_get_frag_stats(mp, &stats);
+	seq_printf(s, "%s", name);
+	for (i = 0; i < MEMPOOL_FRAG_HIST_BUCKETS; i++)
+		seq_printf(s, " %u", stats.hist[i]);
+	seq_puts(s, "\n");
+}
+
+static int mempool_free_hist_show(struct seq_file *s, void *unused)
+{
+	struct neuron_device *nd = s->private;
+	struct mempool_set *mpset = &nd->mpset;
+	struct mempool *host_mp = mpset_host_pool(mpset);
+	u32 channel, region;
+
+	if (host_mp)
+		neuron_dbgfs_show_free_hist(s, "host", host_mp);
+	mutex_lock(&mpset->device_pools_lock);
+	for (channel = 0; channel < V1_MAX_DRAM_CHANNELS; channel++) {
+		for (region = 0; region < MAX_DDR_REGIONS; region++) {
+			struct mempool *mp = &mpset->mp_device[channel][region];
+			char name[16];
+
+			if (!mp->initialized)
+				continue;
+			snprintf(name, sizeof(name), "%u:%u", channel, region);
+			neuron_dbgfs_show_free_hist(s, name, mp);
+		}
+	}
+	mutex_unlock(&mpset->device_pools_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mempool_free_hist);
+
+static void neuron_dbgfs_show_lat_hist(struct seq_file *s, const char *name, const char *op,
+				       const struct mempool_lat_hist *hist)
+{
+	int i;
+
+	seq_printf(s, "%s %s", name, op);
+	for (i = 0; i < MEMPOOL_LAT_HIST_BUCKETS; i++)
+		seq_printf(s, " %llu", READ_ONCE(hist->count[i]));
+	seq_puts(s, "\n");
+}
+
+static int mempool_latency_show(struct seq_file *s, void *unused)
+{
+	struct neuron_device *nd = s->private;
+	struct mempool_set *mpset = &nd->mpset;
+	u32 channel, region;
+
+	neuron_dbgfs_show_lat_hist(s, "host", "alloc", &mpset->host_alloc_lat);
+	neuron_dbgfs_show_lat_hist(s, "host", "free", &mpset->host_free_lat);
+	mutex_lock(&mpset->device_pools_lock);
+	for (channel = 0; channel < V1_MAX_DRAM_CHANNELS; channel++) {
+		for (region = 0; region < MAX_DDR_REGIONS; region++) {
+			struct mempool *mp = &mpset->mp_device[channel][region];
+			char name[16];
+
+			if (!mp->initialized)
+				continue;
+			snprintf(name, sizeof(name), "%u:%u", channel, region);
+			neuron_dbgfs_show_lat_hist(s, name, "alloc", &mp->alloc_lat);
+			neuron_dbgfs_show_lat_hist(s, name, "free", &mp->free_lat);
+		}
+	}
+	mutex_unlock(&mpset->device_pools_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mempool_latency);
+
+void neuron_debugfs_init(struct neuron_device *nd)
+{
+	char name[16];
+
+	snprintf(name, sizeof(name), "neuron%d", nd->device_index);
+	nd->dbgfs_dir = debugfs_create_dir(name, neuron_dbgfs_root);
+	debugfs_create_file("mempools", 0444, nd->dbgfs_dir, nd, &mempools_fops);
+	debugfs_create_file("mempool_free_hist", 0444, nd->dbgfs_dir, nd, &mempool_free_hist_fops);
+	debugfs_create_file("mempool_latency", 0444, nd->dbgfs_dir, nd, &mempool_latency_fops);
+}
+
+void neuron_debugfs_destroy(struct neuron_device *nd)
+{
+	debugfs_remove_recursive(nd->dbgfs_dir);
+	nd->dbgfs_dir = NULL;
+}
@@ -0,0 +1,32 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright 2020, Amazon.com, Inc. or its affiliates. All Rights Reserved
+ */
+
+#ifndef NEURON_DEBUGFS_H
+#define NEURON_DEBUGFS_H
+
+struct dentry;
+struct neuron_device;
+
+// "neuron" directory in debugfs root, created at module load.
+extern struct dentry *neuron_dbgfs_root;
+
+/**
+ * neuron_debugfs_init() - Create the debugfs files of a neuron device.
+ *
+ * The files are created under neuron/neuron<device_index>. Failures are not fatal, the device
+ * works without the files.
+ *
+ * @nd: neuron device
+ */
+void neuron_debugfs_init(struct neuron_device *nd);
+
+/**
+ * neuron_debugfs_destroy() - Remove the debugfs files created by neuron_debugfs_init().
+ *
+ * @nd: neuron device
+ */
+void neuron_debugfs_destroy(struct neuron_device *nd);
+
+#endif
@@ -39,14 +39,19 @@ struct neuron_device {
 	u8 architecture;
 
 	void *cdev; // chardev created for this devices
+	struct dentry *dbgfs_dir; // debugfs directory of this device
 
 	struct neuron_pci_device npdev;
 
 	struct ndma_eng ndma_engine[NUM_DMA_ENG_PER_DEVICE];
+	struct ndma_staging_pool staging; // host buffers ioctls bounce user data through
 
 	void *fw_io_ctx;
 
 	struct mempool_set mpset;
+	// frees memory of the previous owner after it released the device
+	struct workqueue_struct *teardown_wq;
+	struct work_struct teardown_work;
 
 	// memory chunk allocated for notification queue in each neuron core.
 	struct mem_chunk *nq_mc[V1_NC_PER_DEVICE][MAX_NQ_SUPPORTED];
@@ -5,6 +5,7 @@
 
 #define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
 
+#include <linux/module.h>
 #include <linux/string.h>
 #include <linux/delay.h>
 #include <linux/fault-inject.h>
@@ -21,6 +22,23 @@
 DECLARE_FAULT_ATTR(neuron_fail_dma_wait);
 #endif
 
+int ndma_doorbell_batch = 0;
+module_param(ndma_doorbell_batch, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(ndma_doorbell_batch,
+		 "Descriptors queued before the engine is notified in driver initiated copies, 0 - only before waiting for completion");
+
+int ndma_stripe_engines = 1;
+module_param(ndma_stripe_engines, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(ndma_stripe_engines,
+		 "Maximum H2T engines a large driver initiated copy is striped across, 1 - no striping");
+
+int ndma_stripe_min_kb = 4096;
+module_param(ndma_stripe_min_kb, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(ndma_stripe_min_kb, "Smallest copy in KiB which is striped across H2T engines");
+
+// size of the pieces a striped copy is split into, 64 descriptors plus the completion one
+#define NDMA_STRIPE_PIECE_SIZE (64 * MAX_DMA_DESC_SIZE)
+
 struct neuron_device;
 
 void ndma_ack_completed_desc(struct ndma_eng *eng, struct ndma_ring *ring, u32 count)
@@ -33,31 +51,56 @@ void ndma_ack_completed_desc(struct ndma_eng *eng, struct ndma_ring *ring, u32 c
 	udma_cdesc_ack(txq, count);
 }
 
-#define DMA_COMPLETION_MARKER_SIZE sizeof(u32)
+#define DMA_COMPLETION_MARKER_SIZE (DMA_H2T_COMPLETION_SIZE / 2)
 #define DMA_COMPLETION_MARKER 0xabcdef01
 
+/**
+ * ndma_wait_marker() - Poll until a completion descriptor has written the marker.
+ *
+ * @marker: host location the completion descriptor writes DMA_COMPLETION_MARKER to
+ * @count: number of descriptors queued up to and including the completion descriptor
+ *
+ * Return: true if the marker was written, false on timeout.
+ */
+static bool ndma_wait_marker(volatile u32 *marker, u32 count)
+{
+	// One descriptor takes ~4 usec to transfer (64K at 16G/sec) -  wait 100x longer
+	u64 wait = 4 * (u64)count * 100;
+	unsigned long one_loop_sleep = 1; // poll every 10 usecs
+	u64 loop = wait / one_loop_sleep + 1;
+	u64 i;
+
+	for (i = 0; i <= loop; i++) {
+		if (READ_ONCE(*marker) == DMA_COMPLETION_MARKER)
+			return true;
+		udelay(one_loop_sleep);
+	}
+	return false;
+}
+
 /**
  * Wait for completion by start transfer of a DMA between two host memory locations and polling
  * on the host memory for the data to be written.
+ *
+ * The markers live in the engine's preallocated h2t_completion_mc, so waiting does not allocate;
+ * the caller must hold h2t_ring_lock.
+ *
+ * @unstarted: descriptors prepared but not yet started, they are started along with the
+ *             completion descriptor by a single doorbell
  */
-int ndma_memcpy_wait_for_completion(struct ndma_eng *eng, struct ndma_ring *ring, u32 count)
+static int __ndma_memcpy_wait_for_completion(struct ndma_eng *eng, struct ndma_ring *ring,
+					     u32 count, u32 unstarted)
 {
 	struct udma_ring_ptr rxc;
 	int ret = 0;
 	volatile u32 *dst;
 	volatile u32 *src;
-	u64 i;
-
-	// One descriptor takes ~4 usec to transfer (64K at 16G/sec) -  wait 100x longer
-	u64 wait = 4 * count * 100;
-	unsigned long one_loop_sleep = 1; // poll every 10 usecs
-	u64 loop = wait / one_loop_sleep + 1;
 
-	rxc.ptr = kmalloc(DMA_COMPLETION_MARKER_SIZE * 2, GFP_ATOMIC);
-	if (!rxc.ptr) {
-		pr_err("can't allocate memory for completion\n");
+	if (!eng->h2t_completion_mc) {
+		pr_err("no completion buffer for %s q%d\n", eng->udma.name, ring->qid);
 		return -1;
 	}
+	rxc.ptr = eng->h2t_completion_mc->va;
 	dst = (volatile u32 *)(rxc.ptr + DMA_COMPLETION_MARKER_SIZE);
 	src = (volatile u32 *)rxc.ptr;
 
@@ -71,89 +114,251 @@ int ndma_memcpy_wait_for_completion(struct ndma_eng *eng, struct ndma_ring *ring
 					DMA_COMPLETION_MARKER_SIZE, false, false);
 	if (ret) {
 		pr_err("failed to prepare DMA descriptor for %s q%d\n", eng->udma.name, ring->qid);
-		ret = -1;
-		goto error;
+		if (unstarted)
+			udma_m2m_copy_start(&eng->udma, ring->qid, unstarted, unstarted);
+		return -1;
 	}
 
 	count++; // for host to host(completion) descriptor.
 
-	ret = udma_m2m_copy_start(&eng->udma, ring->qid, 1, 1);
+	ret = udma_m2m_copy_start(&eng->udma, ring->qid, unstarted + 1, unstarted + 1);
 	if (ret) {
 		pr_err("failed to start DMA copy for %s q%d\n", eng->udma.name, ring->qid);
-		goto error;
+		return ret;
 	}
 
 #ifdef CONFIG_FAULT_INJECTION
-	if (should_fail(&neuron_fail_dma_wait, 1)) {
-		ret = -ETIMEDOUT;
-		goto error;
-	}
+	if (should_fail(&neuron_fail_dma_wait, 1))
+		return -ETIMEDOUT;
 #endif
-	for (i = 0; i <= loop; i++) {
-		u32 dst_val = READ_ONCE(*dst);
-		// this descriptor is executed, meaning all other have completed
-		if (dst_val == DMA_COMPLETION_MARKER) {
-			// reset in case we are going to use this ring again
-			WRITE_ONCE(*dst, 0);
-			WRITE_ONCE(*src, DMA_COMPLETION_MARKER);
-			// while we don't have completion ring, udma uses completion counter
-			// for keeping track of which descriptors are free and can be allocated
-			// Call ack in order to advance the counter, otherwise we eventually
-			// run out of the descriptors to allocate on this ring
-			ndma_ack_completed_desc(eng, ring, count);
-			break;
-		}
-		udelay(one_loop_sleep);
-	}
-	if (i > loop) {
+	// the completion descriptor is executed, meaning all other have completed
+	if (!ndma_wait_marker(dst, count)) {
 		pr_err("DMA completion timeout for %s q%d\n", eng->udma.name, ring->qid);
-		ret = -1;
-		goto error;
+		return -1;
 	}
+	// reset in case we are going to use this ring again
+	WRITE_ONCE(*dst, 0);
+	WRITE_ONCE(*src, DMA_COMPLETION_MARKER);
+	// while we don't have completion ring, udma uses completion counter
+	// for keeping track of which descriptors are free and can be allocated
+	// Call ack in order to advance the counter, otherwise we eventually
+	// run out of the descriptors to allocate on this ring
+	ndma_ack_completed_desc(eng, ring, count);
+
+	return 0;
+}
 
-error:
-	if (rxc.ptr)
-		kfree(rxc.ptr);
+int ndma_memcpy_wait_for_completion(struct ndma_eng *eng, struct ndma_ring *ring, u32 count)
+{
+	return __ndma_memcpy_wait_for_completion(eng, ring, count, 0);
+}
 
+/**
+ * ndma_memcpy64k_start() - Start the given number of already prepared descriptors.
+ *
+ * Each start is a barrier plus an MMIO write, so descriptors are prepared with
+ * ndma_memcpy64k_prepare() and started in batches.
+ */
+static int ndma_memcpy64k_start(struct ndma_eng *eng, struct ndma_ring *ring, u32 count)
+{
+	int ret;
+
+	ret = udma_m2m_copy_start(&eng->udma, ring->qid, count, count);
+	if (ret)
+		pr_err("failed to start DMA copy for %s q%d\n", eng->udma.name, ring->qid);
 	return ret;
 }
 
-static int ndma_memcpy64k(struct ndma_eng *eng, struct ndma_ring *ring, dma_addr_t src,
-			  dma_addr_t dst, u32 size, bool set_dmb)
+static int ndma_memcpy64k_prepare(struct ndma_eng *eng, struct ndma_ring *ring, dma_addr_t src,
+				  dma_addr_t dst, u32 size, bool set_dmb)
 {
-	int ret = -1;
+	int ret;
+
 	ret = udma_m2m_copy_prepare_one(&eng->udma, ring->qid, src, dst, size, set_dmb, false);
-	if (ret) {
+	if (ret)
 		pr_err("failed to prepare DMA descriptor for %s q%d\n", eng->udma.name, ring->qid);
-		return ret;
+	return ret;
+}
+
+static struct ndma_eng *ndma_h2t_eng(struct neuron_device *nd, u32 nc_id)
+{
+	return &nd->ndma_engine[DMA_ENG_IDX_H2T + (nc_id * V1_DMA_ENG_PER_NC)];
+}
+
+static struct ndma_ring *ndma_h2t_ring(struct ndma_eng *eng)
+{
+	return &eng->queues[MAX_DMA_RINGS - 1].ring_info;
+}
+
+struct ndma_eng *ndma_h2t_lock(struct neuron_device *nd, u32 nc_id)
+{
+	struct ndma_eng *eng = ndma_h2t_eng(nd, nc_id);
+
+	mutex_lock(&eng->h2t_ring_lock);
+	return eng;
+}
+
+void ndma_h2t_unlock(struct ndma_eng *eng)
+{
+	mutex_unlock(&eng->h2t_ring_lock);
+}
+
+int ndma_memcpy_start(struct ndma_eng *eng, dma_addr_t src, dma_addr_t dst, u32 size,
+		      struct ndma_copy *copy)
+{
+	struct ndma_ring *ring = ndma_h2t_ring(eng);
+	volatile u32 *marker_src;
+	dma_addr_t marker_src_addr;
+	u32 chunk_size, offset;
+	int ret;
+
+	if (!eng->h2t_completion_mc) {
+		pr_err("no completion buffer for %s q%d\n", eng->udma.name, ring->qid);
+		return -EINVAL;
 	}
-	// Start the DMA
-	ret = udma_m2m_copy_start(&eng->udma, ring->qid, 1, 1);
-	if (ret) {
-		pr_err("failed to start DMA copy for %s q%d\n", eng->udma.name, ring->qid);
-		return ret;
+	marker_src = eng->h2t_completion_mc->va;
+	marker_src_addr = virt_to_phys((void *)marker_src) | PCIEX8_0_BASE;
+	WRITE_ONCE(*marker_src, DMA_COMPLETION_MARKER);
+	WRITE_ONCE(*copy->marker, 0);
+
+	copy->desc_count = 0;
+	for (offset = 0; offset < size; offset += chunk_size) {
+		chunk_size = min_t(u32, size - offset, MAX_DMA_DESC_SIZE);
+		// the barrier on the last data descriptor orders it before the completion write
+		ret = ndma_memcpy64k_prepare(eng, ring, src + offset, dst + offset, chunk_size,
+					     offset + chunk_size == size);
+		if (ret)
+			goto fail;
+		copy->desc_count++;
+	}
+	ret = ndma_memcpy64k_prepare(eng, ring, marker_src_addr, copy->marker_addr,
+				     DMA_COMPLETION_MARKER_SIZE, false);
+	if (ret)
+		goto fail;
+	copy->desc_count++;
+	return ndma_memcpy64k_start(eng, ring, copy->desc_count);
+
+fail:
+	// descriptors already written must reach the engine or the ring would go out of sync
+	if (copy->desc_count)
+		ndma_memcpy64k_start(eng, ring, copy->desc_count);
+	copy->desc_count = 0;
+	return ret;
+}
+
+int ndma_memcpy_wait(struct ndma_eng *eng, struct ndma_copy *copy)
+{
+	struct ndma_ring *ring = ndma_h2t_ring(eng);
+
+	if (copy->desc_count == 0)
+		return 0;
+#ifdef CONFIG_FAULT_INJECTION
+	if (should_fail(&neuron_fail_dma_wait, 1))
+		return -ETIMEDOUT;
+#endif
+	if (!ndma_wait_marker(copy->marker, copy->desc_count)) {
+		pr_err("DMA completion timeout for %s q%d\n", eng->udma.name, ring->qid);
+		return -ETIMEDOUT;
+	}
+	ndma_ack_completed_desc(eng, ring, copy->desc_count);
+	copy->desc_count = 0;
+	return 0;
+}
+
+/**
+ * ndma_memcpy_striped() - Copy through the H2T engines of several NCs in parallel.
+ *
+ * The NC's own engine is always used, the other NCs' ones only if they are idle, so a striped copy
+ * never waits for another copy to finish and two striped copies can not deadlock. The copy is cut
+ * in pieces which are handed to the engines round robin, each engine has one piece in flight and
+ * gets the next one as soon as it completes.
+ */
+static int ndma_memcpy_striped(struct neuron_device *nd, u32 nc_id, dma_addr_t src,
+			       dma_addr_t dst, u32 size, u32 max_engines)
+{
+	struct ndma_eng *engs[V1_NC_PER_DEVICE];
+	struct ndma_copy copies[V1_NC_PER_DEVICE];
+	u32 eng_nc[V1_NC_PER_DEVICE];
+	u32 count = 0, offset = 0, i;
+	bool in_flight;
+	int ret = 0, err;
+
+	for (i = 0; i < V1_NC_PER_DEVICE && count < max_engines; i++) {
+		u32 id = (nc_id + i) % V1_NC_PER_DEVICE;
+		struct ndma_eng *eng = ndma_h2t_eng(nd, id);
+
+		if (i == 0)
+			mutex_lock(&eng->h2t_ring_lock);
+		else if (!mutex_trylock(&eng->h2t_ring_lock))
+			continue;
+		if (!eng->h2t_completion_mc) {
+			mutex_unlock(&eng->h2t_ring_lock);
+			continue;
+		}
+		copies[count].marker = eng->h2t_completion_mc->va + DMA_COMPLETION_MARKER_SIZE;
+		copies[count].marker_addr =
+			(virt_to_phys(eng->h2t_completion_mc->va) | PCIEX8_0_BASE) +
+			DMA_COMPLETION_MARKER_SIZE;
+		copies[count].desc_count = 0;
+		eng_nc[count] = id;
+		engs[count++] = eng;
+	}
+	if (count == 0) {
+		pr_err("no completion buffer for H2T copies of nc%d\n", nc_id);
+		return -EINVAL;
 	}
 
+	do {
+		in_flight = false;
+		for (i = 0; i < count; i++) {
+			u32 len;
+
+			if (copies[i].desc_count) {
+				ret = ndma_memcpy_wait(engs[i], &copies[i]);
+				if (ret)
+					goto drain;
+			}
+			if (offset == size)
+				continue;
+			len = min_t(u32, size - offset, NDMA_STRIPE_PIECE_SIZE);
+			ret = ndma_memcpy_start(engs[i], src + offset, dst + offset, len, &copies[i]);
+			if (ret)
+				goto drain;
+			trace_dma_memcpy(nd, eng_nc[i], src + offset, dst + offset, len, count);
+			offset += len;
+			in_flight = true;
+		}
+	} while (in_flight);
+
+drain:
+	for (i = 0; i < count; i++) {
+		err = ndma_memcpy_wait(engs[i], &copies[i]);
+		if (err)
+			ret = ret ?: err;
+		mutex_unlock(&engs[i]->h2t_ring_lock);
+	}
 	return ret;
 }
 
 int ndma_memcpy(struct neuron_device *nd, u32 nc_id, dma_addr_t src, dma_addr_t dst, u32 size)
 {
+	u32 stripe_engines = clamp(READ_ONCE(ndma_stripe_engines), 1, V1_NC_PER_DEVICE);
+	u64 stripe_min = (u64)max(READ_ONCE(ndma_stripe_min_kb), 0) * 1024;
 	u32 chunk_size, remaining;
 	int pending_transfers = 0;
 	// max number of usable descriptors - we never allocate the last 16 (max_num_... ) and need to
 	// keep one free for checking completion
 	const u32 sync_threshold = DMA_H2T_DESC_COUNT - UDMA_MAX_NUM_CDESC_PER_CACHE_LINE - 1;
+	// descriptors prepared but not yet started
+	u32 unstarted = 0;
+	u32 batch = READ_ONCE(ndma_doorbell_batch);
 	u32 offset;
 	int ret = 0;
-	struct ndma_eng *eng;
-	struct ndma_queue *queue;
-	struct ndma_ring *ring;
-	int eng_id = DMA_ENG_IDX_H2T + (nc_id * V1_DMA_ENG_PER_NC);
+	struct ndma_eng *eng = ndma_h2t_eng(nd, nc_id);
+	struct ndma_ring *ring = ndma_h2t_ring(eng);
 
-	eng = &(nd->ndma_engine[eng_id]);
-	queue = &eng->queues[MAX_DMA_RINGS - 1];
-	ring = &queue->ring_info;
+	if (stripe_engines > 1 && size >= stripe_min && size > NDMA_STRIPE_PIECE_SIZE)
+		return ndma_memcpy_striped(nd, nc_id, src, dst, size, stripe_engines);
 
 	chunk_size = size < MAX_DMA_DESC_SIZE ? size : MAX_DMA_DESC_SIZE;
 	remaining = size;
@@ -168,99 +373,170 @@ int ndma_memcpy(struct neuron_device *nd, u32 nc_id, dma_addr_t src, dma_addr_t
 		dst_offset = dst + offset;
 		if (++pending_transfers == sync_threshold || chunk_size == remaining) {
 			// no more room, transfer what's been queued so far OR last chunk
-			ret = ndma_memcpy64k(eng, ring, src_offset, dst_offset, chunk_size, true);
+			ret = ndma_memcpy64k_prepare(eng, ring, src_offset, dst_offset, chunk_size, true);
 			if (ret)
 				goto fail;
-			ret = ndma_memcpy_wait_for_completion(eng, ring, pending_transfers);
+			ret = __ndma_memcpy_wait_for_completion(eng, ring, pending_transfers,
+								unstarted + 1);
+			unstarted = 0;
 			if (ret)
 				goto fail;
 			pending_transfers = 0;
 		} else {
-			ret = ndma_memcpy64k(eng, ring, src_offset, dst_offset, chunk_size, false);
+			ret = ndma_memcpy64k_prepare(eng, ring, src_offset, dst_offset, chunk_size, false);
 			if (ret)
 				goto fail;
+			if (++unstarted == batch) {
+				ret = ndma_memcpy64k_start(eng, ring, unstarted);
+				unstarted = 0;
+				if (ret)
+					goto fail;
+			}
 		}
 		trace_dma_memcpy(nd, nc_id, src_offset, dst_offset, chunk_size, pending_transfers);
 	}
 
 fail:
+	// descriptors already written must reach the engine or the ring would go out of sync
+	if (unstarted)
+		ndma_memcpy64k_start(eng, ring, unstarted);
 	mutex_unlock(&eng->h2t_ring_lock);
 	return ret;
 }
 
+/** Position in the memory a DMA copy reads from or writes to.
+ *
+ * Scatter-gather host chunks are not contiguous for the device, the cursor moves through their DMA
+ * segments so a copy can be split at segment boundaries.
+ */
+struct ndma_cursor {
+	struct mem_chunk *mc; // chunk being walked, NULL for a kernel buffer
+	dma_addr_t addr; // device address at the current position
+	u32 len; // bytes contiguous for the device from addr
+	u32 seg; // current DMA segment of a scatter-gather chunk
+};
+
+static void ndma_cursor_init_buf(struct ndma_cursor *c, void *buffer, u32 offset)
+{
+	c->mc = NULL;
+	c->addr = (virt_to_phys(buffer) | PCIEX8_0_BASE) + offset;
+	c->len = U32_MAX;
+	c->seg = 0;
+}
+
+static void ndma_cursor_init_mc(struct ndma_cursor *c, struct mem_chunk *mc, u32 offset)
+{
+	c->mc = mc;
+	c->seg = 0;
+	if (mc->sg) {
+		while (c->seg < mc->sg->nr_ranges - 1 && offset >= mc->sg->ranges[c->seg].size) {
+			offset -= mc->sg->ranges[c->seg].size;
+			c->seg++;
+		}
+		c->addr = (mc->sg->ranges[c->seg].pa | PCIEX8_0_BASE) + offset;
+		c->len = mc->sg->ranges[c->seg].size - offset;
+	} else if (mc->mem_location == MEM_LOC_HOST) {
+		c->addr = (virt_to_phys(mc->va) | PCIEX8_0_BASE) + offset;
+		c->len = mc->size - offset;
+	} else {
+		c->addr = mc->pa + offset;
+		c->len = mc->size - offset;
+	}
+}
+
+static void ndma_cursor_advance(struct ndma_cursor *c, u32 size)
+{
+	c->addr += size;
+	c->len -= size;
+	if (c->len == 0 && c->mc && c->mc->sg && c->seg + 1 < c->mc->sg->nr_ranges) {
+		c->seg++;
+		c->addr = c->mc->sg->ranges[c->seg].pa | PCIEX8_0_BASE;
+		c->len = c->mc->sg->ranges[c->seg].size;
+	}
+}
+
+/**
+ * ndma_memcpy_cursor() - Copy between two cursors, one ndma_memcpy() per contiguous piece.
+ */
+static int ndma_memcpy_cursor(struct neuron_device *nd, u32 nc_id, struct ndma_cursor *src,
+			      struct ndma_cursor *dst, u32 size)
+{
+	int ret;
+
+	while (size) {
+		u32 chunk_size = min3(size, src->len, dst->len);
+
+		if (chunk_size == 0)
+			return -EINVAL;
+		ret = ndma_memcpy(nd, nc_id, src->addr, dst->addr, chunk_size);
+		if (ret)
+			return ret;
+		ndma_cursor_advance(src, chunk_size);
+		ndma_cursor_advance(dst, chunk_size);
+		size -= chunk_size;
+	}
+	return 0;
+}
+
 int ndma_memcpy_mc(struct neuron_device *nd, struct mem_chunk *src_mc, struct mem_chunk *dst_mc,
 		   u32 src_offset, u32 dst_offset, u32 size)
 {
-	dma_addr_t src_pa, dst_pa;
+	struct ndma_cursor src, dst;
 	u32 nc_id = 0; //default use NC 0
 
-	if (src_mc->mem_location == MEM_LOC_HOST) {
-		src_pa = virt_to_phys(src_mc->va) | PCIEX8_0_BASE;
-	} else {
-		src_pa = src_mc->pa;
+	if (src_mc->mem_location == MEM_LOC_DEVICE)
 		nc_id = src_mc->nc_id;
-	}
-	src_pa += src_offset;
-
-	if (dst_mc->mem_location == MEM_LOC_HOST) {
-		dst_pa = virt_to_phys(dst_mc->va) | PCIEX8_0_BASE;
-	} else {
-		dst_pa = dst_mc->pa;
+	if (dst_mc->mem_location == MEM_LOC_DEVICE)
 		nc_id = dst_mc->nc_id;
-	}
-	dst_pa += dst_offset;
+	ndma_cursor_init_mc(&src, src_mc, src_offset);
+	ndma_cursor_init_mc(&dst, dst_mc, dst_offset);
 
-	return ndma_memcpy(nd, nc_id, src_pa, dst_pa, size);
+	mc_account_dma(src_mc, size);
+	mc_account_dma(dst_mc, size);
+	return ndma_memcpy_cursor(nd, nc_id, &src, &dst, size);
 }
 
 int ndma_memcpy_buf_to_mc(struct neuron_device *nd, void *buffer, u32 src_offset,
 			  struct mem_chunk *dst_mc, u32 dst_offset, u32 size)
 {
-	dma_addr_t src_pa;
-	dma_addr_t dst_pa;
+	struct ndma_cursor src, dst;
 	u32 nc_id = 0;
 
-	src_pa = virt_to_phys(buffer) | PCIEX8_0_BASE;
-	src_pa += src_offset;
-
-	if (dst_mc->mem_location == MEM_LOC_HOST) {
-		dst_pa = virt_to_phys(dst_mc->va) | PCIEX8_0_BASE;
-	} else {
-		dst_pa = dst_mc->pa;
+	if (dst_mc->mem_location == MEM_LOC_DEVICE)
 		nc_id = dst_mc->nc_id;
-	}
-	dst_pa += dst_offset;
+	ndma_cursor_init_buf(&src, buffer, src_offset);
+	ndma_cursor_init_mc(&dst, dst_mc, dst_offset);
 
-	return ndma_memcpy(nd, nc_id, src_pa, dst_pa, size);
+	mc_account_dma(dst_mc, size);
+	return ndma_memcpy_cursor(nd, nc_id, &src, &dst, size);
 }
 
 int ndma_memcpy_buf_from_mc(struct neuron_device *nd, void *buffer, u32 dst_offset,
 			    struct mem_chunk *src_mc, u32 src_offset, u32 size)
 {
-	dma_addr_t src_pa;
-	dma_addr_t dst_pa;
+	struct ndma_cursor src, dst;
 	u32 nc_id = 0;
 
-	dst_pa = virt_to_phys(buffer) | PCIEX8_0_BASE;
-	dst_pa += dst_offset;
-
-	if (src_mc->mem_location == MEM_LOC_HOST) {
-		src_pa = virt_to_phys(src_mc->va) | PCIEX8_0_BASE;
-	} else {
-		src_pa = src_mc->pa;
+	if (src_mc->mem_location == MEM_LOC_DEVICE)
 		nc_id = src_mc->nc_id;
-	}
-	src_pa += src_offset;
+	ndma_cursor_init_mc(&src, src_mc, src_offset);
+	ndma_cursor_init_buf(&dst, buffer, dst_offset);
 
-	return ndma_memcpy(nd, nc_id, src_pa, dst_pa, size);
+	mc_account_dma(src_mc, size);
+	return ndma_memcpy_cursor(nd, nc_id, &src, &dst, size);
 }
 
 /**
  * Check whether given address is allocated in host memory by given pid and in given ND.
+ *
+ * A transfer must not cross the end of a scatter-gather chunk's DMA segment, the next segment is
+ * not contiguous for the device.
  */
-static bool ndma_is_valid_host_mem_from_nd(pid_t pid, u8 nd_index, phys_addr_t pa)
+static bool ndma_is_valid_host_mem_from_nd(pid_t pid, u8 nd_index, phys_addr_t pa, u32 len)
 {
 	struct neuron_device *nd;
+	struct mc_range *range;
+
 	if (nd_index >= MAX_NEURON_DEVICE_COUNT)
 		return false;
 	nd = neuron_pci_get_device(nd_index);
@@ -269,27 +545,33 @@ static bool ndma_is_valid_host_mem_from_nd(pid_t pid, u8 nd_index, phys_addr_t p
 	if (pid != nd->current_pid)
 		return false;
 
-	return mpset_search_mc(&nd->mpset, pa) != NULL;
+	range = mpset_search_range(&nd->mpset, pa);
+	if (range == NULL)
+		return false;
+	if (range->mc->sg && pa + len > range->pa + range->size)
+		return false;
+	return true;
 }
 
 /**
  * Check whether given PA is valid host memory allocation.
  */
-static bool ndma_is_valid_host_mem(struct neuron_device *nd, phys_addr_t pa)
+static bool ndma_is_valid_host_mem(struct neuron_device *nd, phys_addr_t pa, u32 len)
 {
 	bool found = false;
 	int i;
 
-	read_lock(&nd->mpset.rblock);
+	// host index lookups are lockless, chunks are freed only after a grace period.
+	rcu_read_lock();
 	// common case - check whether the PA is allocated from the current ND
-	found = ndma_is_valid_host_mem_from_nd(nd->current_pid, nd->device_index, pa);
+	found = ndma_is_valid_host_mem_from_nd(nd->current_pid, nd->device_index, pa, len);
 	if (found)
 		goto done;
 	// chaining - check neighbor NDs
-	found = ndma_is_valid_host_mem_from_nd(nd->current_pid, nd->device_index - 1, pa);
+	found = ndma_is_valid_host_mem_from_nd(nd->current_pid, nd->device_index - 1, pa, len);
 	if (found)
 		goto done;
-	found = ndma_is_valid_host_mem_from_nd(nd->current_pid, nd->device_index + 1, pa);
+	found = ndma_is_valid_host_mem_from_nd(nd->current_pid, nd->device_index + 1, pa, len);
 	if (found)
 		goto done;
 	// check all devices
@@ -297,13 +579,13 @@ static bool ndma_is_valid_host_mem(struct neuron_device *nd, phys_addr_t pa)
 		// skip already checked devices
 		if (i >= nd->device_index - 1 && i <= nd->device_index + 1)
 			continue;
-		found = ndma_is_valid_host_mem_from_nd(nd->current_pid, i, pa);
+		found = ndma_is_valid_host_mem_from_nd(nd->current_pid, i, pa, len);
 		if (found)
 			goto done;
 	}
 
 done:
-	read_unlock(&nd->mpset.rblock);
+	rcu_read_unlock();
 	if (!found)
 		pr_err("nd%d:invalid host memory(%#llx) in DMA descriptor\n", nd->device_index, pa);
 	return found;
@@ -316,13 +598,16 @@ int ndma_memcpy_dma_copy_descriptors(struct neuron_device *nd, void *buffer, u32
 	u32 curr_size = size;
 	union udma_desc *desc = (union udma_desc *)buffer;
 	phys_addr_t pa;
+	u32 len;
 
 	// Check the validity of the desc physical addresses
 	while (curr_size > 0) {
 		if (desc_type == NEURON_DMA_QUEUE_TYPE_TX) {
 			pa = desc->tx.buf_ptr;
+			len = desc->tx.len_ctrl & M2S_DESC_LEN_MASK;
 		} else if (desc_type == NEURON_DMA_QUEUE_TYPE_RX) {
 			pa = desc->rx.buf1_ptr;
+			len = desc->rx.len_ctrl & M2S_DESC_LEN_MASK;
 		} else {
 			return -1;
 		}
@@ -334,7 +619,7 @@ int ndma_memcpy_dma_copy_descriptors(struct neuron_device *nd, void *buffer, u32
 		// (that will look as though host is also set)
 		if (((pa & PCIEX8_0_BASE) == PCIEX8_0_BASE) &&
 		    ((pa & PCIEX4_1_BASE) != PCIEX4_1_BASE)) {
-			if (!ndma_is_valid_host_mem(nd, pa & ~PCIEX8_0_BASE))
+			if (!ndma_is_valid_host_mem(nd, pa & ~PCIEX8_0_BASE, len))
 				return -EINVAL;
 		}
 		curr_size = curr_size - sizeof(union udma_desc);
@@ -87,6 +87,59 @@ int ndma_memcpy_dma_copy_descriptors(struct neuron_device *nd, void *buffer, u32
  */
 int ndma_memcpy(struct neuron_device *nd, u32 nc_id, dma_addr_t src, dma_addr_t dst, u32 size);
 
+/** A copy started by ndma_memcpy_start() and not yet waited for.
+ *
+ * Copies on a ring complete in the order they were started, so they must be waited for in that
+ * order too.
+ */
+struct ndma_copy {
+	volatile u32 *marker; // [in] host location written by the device when the copy is done
+	dma_addr_t marker_addr; // [in] device address of marker
+	u32 desc_count; // descriptors still to be acked, including the completion descriptor
+};
+
+/**
+ * ndma_h2t_lock() - Lock the host to device ring of an NC for ndma_memcpy_start()/ndma_memcpy_wait().
+ *
+ * @nd: neuron device
+ * @nc_id: neuron core whose H2T engine is used
+ *
+ * Return: the locked engine.
+ */
+struct ndma_eng *ndma_h2t_lock(struct neuron_device *nd, u32 nc_id);
+
+/**
+ * ndma_h2t_unlock() - Unlock the ring locked by ndma_h2t_lock(), all copies must have been waited for.
+ */
+void ndma_h2t_unlock(struct ndma_eng *eng);
+
+/**
+ * ndma_memcpy_start() - Queue a copy on a locked H2T ring and start it without waiting.
+ *
+ * The copy takes one descriptor per 64KiB plus one completion descriptor, all started with a single
+ * doorbell. The caller must keep the descriptors of all started copies below the ring size.
+ *
+ * @eng: engine locked with ndma_h2t_lock()
+ * @src: source device address
+ * @dst: destination device address
+ * @size: copy size
+ * @copy: copy state, marker and marker_addr must be set
+ *
+ * Return: 0 if the copy is started, a negative error code otherwise.
+ */
+int ndma_memcpy_start(struct ndma_eng *eng, dma_addr_t src, dma_addr_t dst, u32 size,
+		      struct ndma_copy *copy);
+
+/**
+ * ndma_memcpy_wait() - Wait for a copy started by ndma_memcpy_start().
+ *
+ * @eng: engine locked with ndma_h2t_lock()
+ * @copy: the oldest copy not yet waited for
+ *
+ * Return: 0 if the copy completed, -ETIMEDOUT otherwise.
+ */
+int ndma_memcpy_wait(struct ndma_eng *eng, struct ndma_copy *copy);
+
 /**
  * ndma_memcpy_wait_for_completion() - Wait for already initiated DMA transfer to complete.
  *
@@ -20,6 +20,46 @@ struct neuron_ioctl_mem_alloc {
 	__u64 *mem_handle; // [out] Allocated memory handle would stored here.
 };
 
+struct neuron_ioctl_mem_alloc_entry {
+	__u64 size; // [in] Allocation size
+	__u32 host_memory; // [in] If true allocates from host memory; else allocates from device memory
+	__u32 dram_channel; // [in/out] DRAM channel in device memory, returns the channel used
+	__u32 dram_region; // [in/out] DRAM region in device memory, returns the region used
+	__u32 nc_id; // [in] NeuronCore id
+	__u32 flags; // [in] NEURON_MEM_ALLOC_FLAG_* flags
+	__u32 reserved; // reserved, must be 0
+	__u64 mem_handle; // [out] Allocated memory handle
+	__u64 pa; // [out] Physical address of the memory(same as NEURON_IOCTL_MEM_GET_PA)
+};
+
+// Back the host memory with physically contiguous huge(2MB on x86) pages. The memory is a single
+// allocation of the kernel's page allocator, larger sizes(above 4MB on x86 by default) fail with
+// E2BIG, SCATTER_GATHER should be used for them instead.
+#define NEURON_MEM_ALLOC_FLAG_HUGE_PAGE (1 << 0)
+// Device memory can be moved by NEURON_IOCTL_MEM_COMPACT, its pa must be re-read after compaction.
+#define NEURON_MEM_ALLOC_FLAG_RELOCATABLE (1 << 1)
+// Host memory is fully written(e.g. by DMA) before being read, skip zeroing reused buffers.
+#define NEURON_MEM_ALLOC_FLAG_NO_ZERO (1 << 2)
+// Device memory placed by the driver, dram_channel/dram_region inputs are ignored and the chosen
+// ones are returned.
+#define NEURON_MEM_ALLOC_FLAG_AUTO_PLACEMENT (1 << 3)
+// Host memory is built from discontiguous pages, the device sees it as the segments returned by
+// NEURON_IOCTL_MEM_GET_SEGMENTS. The pa of the memory is that of the first segment.
+#define NEURON_MEM_ALLOC_FLAG_SCATTER_GATHER (1 << 4)
+
+// Maximum number of entries in a batched alloc/free.
+#define NEURON_IOCTL_MEM_BATCH_MAX 1024
+
+struct neuron_ioctl_mem_alloc_batch {
+	__u32 count; // [in] Number of entries
+	struct neuron_ioctl_mem_alloc_entry *entries; // [in/out] Allocation requests and results
+};
+
+struct neuron_ioctl_mem_free_batch {
+	__u32 count; // [in] Number of handles
+	__u64 *mem_handles; // [in] Memory handles to be freed
+};
+
 struct neuron_ioctl_device_init {
 	/* Splits DRAM in the device into smaller regions.
 	 * This improves performance of DDR by allowing parallel DMA using different regions.
@@ -33,6 +73,44 @@ struct neuron_ioctl_mem_get_pa {
 	__u64 *pa; // [out] Physical address of the memory
 };
 
+struct neuron_ioctl_mem_get_mmap_offset {
+	__u64 mem_handle; // [in] Memory handle of the allocated host memory.
+	__u64 mmap_offset; // [out] mmap() offset of the memory
+};
+
+struct neuron_ioctl_mem_compact {
+	__u32 dram_channel; // [in] DRAM channel of the pool to compact
+	__u32 dram_region; // [in] DRAM region of the pool to compact
+	__u32 moved_count; // [out] Number of relocated memory handles
+	__u32 reserved; // reserved, must be 0
+	__u64 moved_size; // [out] Total size of relocated memory
+	__u64 generation; // [out] Device memory generation after compaction
+};
+
+struct neuron_ioctl_mem_segment {
+	__u64 pa; // physical address of the segment as used in DMA descriptors
+	__u64 size; // size of the segment
+};
+
+struct neuron_ioctl_mem_get_segments {
+	__u64 mem_handle; // [in] Memory handle
+	__u32 count; // [in] Number of entries in segments, [out] Number of segments of the memory
+	__u32 reserved; // reserved, must be 0
+	struct neuron_ioctl_mem_segment *segments; // [out] Segments in memory offset order
+};
+
+struct neuron_ioctl_mem_register {
+	__u64 addr; // [in] User address of the buffer
+	__u64 size; // [in] Size of the buffer
+	__u32 nc_id; // [in] NeuronCore id the pinned memory is charged to
+	__u32 reserved; // reserved, must be 0
+	__u64 *mem_handle; // [out] Memory handle of the registered buffer
+};
+
+struct neuron_ioctl_mem_deregister {
+	__u64 mem_handle; // [in] Memory handle returned by NEURON_IOCTL_MEM_REGISTER
+};
+
 struct neuron_ioctl_mem_free {
 	__u64 mem_handle; // [in] Memory handle to be freed.
 };
@@ -241,6 +319,43 @@ struct neuron_ioctl_device_info {
  *  This can be used by applications to DMA.
  */
 #define NEURON_IOCTL_MEM_GET_PA _IOR(NEURON_IOCTL_BASE, 25, struct neuron_ioctl_mem_get_pa *)
+/** Allocate multiple memory chunks and return their handles and physical addresses.
+ *  Either all the allocations succeed or none.
+ */
+#define NEURON_IOCTL_MEM_ALLOC_BATCH _IOWR(NEURON_IOCTL_BASE, 26, struct neuron_ioctl_mem_alloc_batch *)
+/** Free multiple memory handles.
+ *  Either all the handles are freed or none, the call fails with EINVAL if any handle is invalid,
+ *  repeated or a registered buffer.
+ */
+#define NEURON_IOCTL_MEM_FREE_BATCH _IOR(NEURON_IOCTL_BASE, 27, struct neuron_ioctl_mem_free_batch *)
+/** Returns mmap() offset of given host memory_handle.
+ *  Mapping the offset gives direct access to the memory, which stays valid until both freed and
+ *  unmapped. Only host memory of at least a page in size can be mapped. The offset refers to the
+ *  handle, it can only be mapped through the same file and only until the handle is freed.
+ */
+#define NEURON_IOCTL_MEM_GET_MMAP_OFFSET _IOWR(NEURON_IOCTL_BASE, 28, struct neuron_ioctl_mem_get_mmap_offset *)
+/** Compacts a device memory pool by moving memory allocated with NEURON_MEM_ALLOC_FLAG_RELOCATABLE.
+ *  The relocatable memory must not be in use during the call. Generation changes whenever memory
+ *  is moved, the pa of relocatable memory handles must then be read again.
+ */
+#define NEURON_IOCTL_MEM_COMPACT _IOWR(NEURON_IOCTL_BASE, 29, struct neuron_ioctl_mem_compact *)
+/** Returns the physically contiguous segments of given memory_handle.
+ *  Memory allocated with NEURON_MEM_ALLOC_FLAG_SCATTER_GATHER can have many segments, a DMA
+ *  descriptor must not cross the end of one. Any other memory has a single segment. Up to count
+ *  segments are returned, count is set to the number of segments the memory has.
+ */
+#define NEURON_IOCTL_MEM_GET_SEGMENTS _IOWR(NEURON_IOCTL_BASE, 20, struct neuron_ioctl_mem_get_segments *)
+/** Pins a buffer of the calling process and returns a host memory handle for it.
+ *  The device reads and writes the buffer directly, the handle can be used with MEM_COPY, as the
+ *  memory handle of MEM_BUF_COPY and its segments(see NEURON_IOCTL_MEM_GET_SEGMENTS) in DMA
+ *  descriptors. It can not be mmap()ed or freed with MEM_FREE. Registering the same buffer again
+ *  returns the same handle and takes another reference, each registration is undone with
+ *  NEURON_IOCTL_MEM_DEREGISTER. The buffer must stay mapped while it is registered, registering
+ *  it again after it was remapped fails with EBUSY. Pinned memory counts against RLIMIT_MEMLOCK.
+ */
+#define NEURON_IOCTL_MEM_REGISTER _IOR(NEURON_IOCTL_BASE, 14, struct neuron_ioctl_mem_register *)
+/** Drops a reference of a registered buffer, the last one unpins it. */
+#define NEURON_IOCTL_MEM_DEREGISTER _IOR(NEURON_IOCTL_BASE, 15, struct neuron_ioctl_mem_deregister *)
 
 
 /** Initialize DMA engine. */
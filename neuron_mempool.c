@@ -9,12 +9,20 @@
 #include <linux/errno.h>
 #include <linux/genalloc.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
 #include <linux/mutex.h>
+#include <linux/sched/mm.h>
 #include <linux/module.h>
+#include <linux/shrinker.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
 #include <linux/types.h>
 #include <linux/dma-mapping.h>
 #include <linux/fault-inject.h>
+#include <linux/version.h>
 
 #include "neuron_mempool.h"
 #include "neuron_device.h"
@@ -24,388 +32,2622 @@ int mempool_min_alloc_size = 256;
 module_param(mempool_min_alloc_size, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
 MODULE_PARM_DESC(mempool_min_alloc_size, "Minimum size for device memory allocation");
 
+int mempool_host_freelist_max = 64;
+
+module_param(mempool_host_freelist_max, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(mempool_host_freelist_max,
+		 "Maximum number of freed host buffers kept for reuse in each size class");
+
+int mempool_coherent_cache_mb = 256;
+
+module_param(mempool_coherent_cache_mb, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(mempool_coherent_cache_mb,
+		 "Maximum size in MB of freed coherent host buffers kept for reuse per device");
+
+int mempool_zeroed_pool_max = 8;
+
+module_param(mempool_zeroed_pool_max, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(mempool_zeroed_pool_max,
+		 "Number of pre-zeroed host buffers kept in each page or larger size class, 0 to disable");
+
+int mempool_host_reserve_mb = 0;
+
+module_param(mempool_host_reserve_mb, int, S_IRUSR | S_IRGRP);
+MODULE_PARM_DESC(mempool_host_reserve_mb,
+		 "Size in MB of contiguous host memory reserved per device at probe for large host allocations, 0 to disable");
+
+int mempool_placement_dma_weight = 50;
+
+module_param(mempool_placement_dma_weight, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(mempool_placement_dma_weight,
+		 "Weight in percent of recent DMA traffic against memory use when device memory is placed automatically");
+
 #ifdef CONFIG_FAULT_INJECTION
 DECLARE_FAULT_ATTR(neuron_fail_mc_alloc);
 #endif
 
-// Limit for using kmalloc
-#define MEMPOOL_KMALLOC_MAX_SIZE (256 * 1024)
-
-/**
- * mc_insert_node() - Insert a mem chunk to the tree
- *
- * @root: binary tree root
- * @mc: memory chunk that needs to be inserted
+/** A free block in buddy allocator.
  */
-static void mc_insert_node(struct rb_root *root, struct mem_chunk *mc)
-{
-	struct rb_node **link = &root->rb_node, *parent = NULL;
-	phys_addr_t pa = mc->pa;
+struct mp_buddy_block {
+	struct rb_node node; // link in mp_buddy->free_blocks
+	u64 addr; // start address of the block
+};
 
-	/* Go to the bottom of the tree */
-	while (*link) {
-		parent = *link;
-		struct mem_chunk *mc = rb_entry(parent, struct mem_chunk, node);
+// cache for struct mem_chunk
+static struct kmem_cache *mc_cache;
+// cache for struct mp_buddy_block
+static struct kmem_cache *mp_buddy_block_cache;
 
-		if (mc->pa > pa) {
-			link = &(*link)->rb_left;
-		} else {
-			link = &(*link)->rb_right;
-		}
+int mempool_module_init(void)
+{
+	mc_cache = kmem_cache_create("neuron_mem_chunk", sizeof(struct mem_chunk), 0,
+				     SLAB_HWCACHE_ALIGN, NULL);
+	if (mc_cache == NULL)
+		return -ENOMEM;
+	mp_buddy_block_cache = kmem_cache_create("neuron_buddy_block", sizeof(struct mp_buddy_block),
+						 0, 0, NULL);
+	if (mp_buddy_block_cache == NULL) {
+		kmem_cache_destroy(mc_cache);
+		mc_cache = NULL;
+		return -ENOMEM;
 	}
+	return 0;
+}
 
-	/* Put the new node there */
-	rb_link_node(&mc->node, parent, link);
-	rb_insert_color(&mc->node, root);
+void mempool_module_exit(void)
+{
+	// wait for host chunks freed with call_rcu()
+	rcu_barrier();
+	kmem_cache_destroy(mp_buddy_block_cache);
+	mp_buddy_block_cache = NULL;
+	kmem_cache_destroy(mc_cache);
+	mc_cache = NULL;
 }
 
 /**
- * mc_remove_node() - Remove a mem chunk from the tree
+ * mc_host_size_class() - Returns the freelist index for given host allocation size.
  *
- * @root: binary tree root
- * @mc: memory chunk that needs to be removed
+ * @size: allocation size(must not be greater than MEMPOOL_KMALLOC_MAX_SIZE)
  */
-void mc_remove_node(struct rb_root *root, struct mem_chunk *mc)
+static int mc_host_size_class(u32 size)
+{
+	if (size <= (1 << MC_HOST_MIN_CLASS_SHIFT))
+		return 0;
+	return order_base_2(size) - MC_HOST_MIN_CLASS_SHIFT;
+}
+
+static u32 mc_host_class_size(int size_class)
+{
+	return 1 << (size_class + MC_HOST_MIN_CLASS_SHIFT);
+}
+
+static void *mc_host_freelist_pop(struct mc_host_freelist *freelist)
+{
+	struct list_head *entry;
+
+	if (freelist->count == 0)
+		return NULL;
+	entry = freelist->head.next;
+	list_del(entry);
+	freelist->count--;
+	return entry;
+}
+
+static void mc_host_freelist_push(struct mc_host_freelist *freelist, void *va)
+{
+	list_add((struct list_head *)va, &freelist->head);
+	freelist->count++;
+}
+
+static void mc_host_freelist_drain(struct mc_host_freelist *freelist)
+{
+	void *va;
+
+	while ((va = mc_host_freelist_pop(freelist)) != NULL)
+		kfree(va);
+}
+
+static bool mc_host_has_zeroed_pool(int size_class)
 {
-	rb_erase(&mc->node, root);
+	return size_class >= MC_HOST_ZEROED_MIN_CLASS && mempool_zeroed_pool_max > 0;
 }
 
 /**
- * mp_init() Initialize the mempool structure with given values.
- * Creates a backing gen_pool if the mem_location is device DRAM.
+ * mc_host_buf_alloc() - Allocate a host buffer, reusing a freed buffer if possible.
+ * Caller must hold mpset->host_lock.
  *
- * @mp: pointer to mempool that needs to be initialized
- * @start_addr: starting address of the pool
- * @pool_size: size of the pool.
- * @mem_location: location of the backing memory.
- * @dram_channel: device dram channel backing this pool(applicable only if mem_location is device).
- * @dram_region: device dram region backing this pool(applicable only if mem_location is device).
+ * Zeroed allocations prefer the pre-zeroed pool, so the memset is off the allocating thread.
+ * Allocations which do not need zeroing prefer freed buffers to keep the zeroed pool for others.
  *
- * Return: 0 if pool is created, a negative error code otherwise.
+ * @mpset: mpset which owns the freelists
+ * @size: allocation size
+ * @zero: zero the buffer, buffers new to the mpset are zeroed regardless
+ *
+ * Return: virtual address of the buffer, NULL on failure.
  */
-static int mp_init(struct mempool *mp, u64 start_addr, size_t pool_size,
-		   enum mem_location mem_location, u32 dram_channel, u32 dram_region)
+static void *mc_host_buf_alloc(struct mempool_set *mpset, u32 size, bool zero)
 {
-	int ret;
-
-	memset(mp, 0, sizeof(*mp));
-
-	mp->mem_location = mem_location;
-	mp->dram_channel = dram_channel;
-	mp->dram_region = dram_region;
-	INIT_LIST_HEAD(&mp->device_allocated_head);
-	mp->gen_pool = gen_pool_create(ilog2(mempool_min_alloc_size), -1);
-	if (mp->gen_pool == NULL)
-		return -ENOMEM;
+	int size_class = mc_host_size_class(size);
+	struct mc_host_freelist *freelist = &mpset->host_freelist[size_class];
+	struct mc_host_freelist *zeroed = &mpset->host_zeroed[size_class];
+	void *va;
 
-	// 0 is special since we cant differentiate failure(NULL) in gen_pool_alloc().
-	// so avoid starting at 0 by sacrificing first chunk.
-	if (start_addr == 0) {
-		start_addr = mempool_min_alloc_size;
-		pool_size -= mempool_min_alloc_size;
+	if (mc_host_has_zeroed_pool(size_class)) {
+		// only the classes used for zeroed allocations are kept filled
+		if (zero)
+			__set_bit(size_class, &mpset->host_zeroed_refill);
+		if (zeroed->count <= mempool_zeroed_pool_max / 2 &&
+		    test_bit(size_class, &mpset->host_zeroed_refill))
+			schedule_work(&mpset->host_zero_work);
+		if (zero || freelist->count == 0) {
+			va = mc_host_freelist_pop(zeroed);
+			if (va) {
+				// the freelist link was kept in the buffer
+				memset(va, 0, sizeof(struct list_head));
+				mpset->host_zeroed_hits++;
+				return va;
+			}
+		}
 	}
-	ret = gen_pool_add_virt(mp->gen_pool, start_addr, start_addr, pool_size, -1);
-	if (ret) {
-		gen_pool_destroy(mp->gen_pool);
-		return ret;
+
+	va = mc_host_freelist_pop(freelist);
+	if (va) {
+		mpset->host_freelist_hits++;
+	} else {
+		mpset->host_freelist_misses++;
+		va = kmalloc_node(mc_host_class_size(size_class), GFP_KERNEL, mpset->numa_node);
+		if (va == NULL)
+			return NULL;
+		zero = true;
 	}
+	if (zero)
+		memset(va, 0, size);
+	return va;
+}
 
-	snprintf(mp->name, sizeof(mp->name), "device mempool [%d:%d]", dram_channel, dram_region);
-	mp->region_size = pool_size;
-	mp->initialized = 1;
+/**
+ * mc_host_buf_free() - Return a buffer allocated by mc_host_buf_alloc() to its freelist.
+ * Caller must hold mpset->host_lock.
+ */
+static void mc_host_buf_free(struct mempool_set *mpset, void *va, u32 size)
+{
+	int size_class = mc_host_size_class(size);
+	struct mc_host_freelist *freelist = &mpset->host_freelist[size_class];
 
-	return 0;
+	if (freelist->count >= mempool_host_freelist_max) {
+		kfree(va);
+		return;
+	}
+	mc_host_freelist_push(freelist, va);
+	// let the worker zero it if the zeroed pool is short
+	if (mc_host_has_zeroed_pool(size_class) &&
+	    test_bit(size_class, &mpset->host_zeroed_refill) &&
+	    mpset->host_zeroed[size_class].count < mempool_zeroed_pool_max)
+		schedule_work(&mpset->host_zero_work);
 }
 
 /**
- * Frees all the chunks associated with the mempool.
+ * mpset_host_zero_work() - Refill the pools of zeroed host buffers.
+ *
+ * Freed buffers are zeroed first, then new buffers are allocated until each pool in
+ * host_zeroed_refill has mempool_zeroed_pool_max buffers. Zeroing is done without holding
+ * host_lock.
  */
-static void mp_free_device_mem(struct mempool *mp)
+static void mpset_host_zero_work(struct work_struct *work)
 {
-	BUG_ON(mp == NULL);
-	if (!mp->initialized)
-		return;
+	struct mempool_set *mpset = container_of(work, struct mempool_set, host_zero_work);
+	int i;
+
+	for (i = MC_HOST_ZEROED_MIN_CLASS; i < MC_HOST_SIZE_CLASSES; i++) {
+		u32 size = mc_host_class_size(i);
 
-	if (mp->gen_pool != NULL) {
-		// Free all entries
-		struct list_head *this, *next;
+		for (;;) {
+			void *va;
 
-		list_for_each_safe (this, next, &mp->device_allocated_head) {
-			struct mem_chunk *mc =
-				list_entry(this, struct mem_chunk, device_allocated_list);
-			if (mc->va) {
-				gen_pool_free(mp->gen_pool, (unsigned long)mc->va, mc->size);
-				mc->va = NULL;
+			mutex_lock(&mpset->host_lock);
+			if (!test_bit(i, &mpset->host_zeroed_refill) ||
+			    mpset->host_zeroed[i].count >= mempool_zeroed_pool_max) {
+				mutex_unlock(&mpset->host_lock);
+				break;
 			}
-			list_del(&mc->device_allocated_list);
-			kfree(mc);
+			va = mc_host_freelist_pop(&mpset->host_freelist[i]);
+			mutex_unlock(&mpset->host_lock);
+
+			if (va == NULL) {
+				va = kmalloc_node(size, GFP_KERNEL | __GFP_NOWARN, mpset->numa_node);
+				if (va == NULL)
+					return;
+			}
+			memset(va, 0, size);
+
+			mutex_lock(&mpset->host_lock);
+			mc_host_freelist_push(&mpset->host_zeroed[i], va);
+			mutex_unlock(&mpset->host_lock);
 		}
-		mp->allocated_size = 0;
 	}
 }
 
+/** Header kept at the start of a free buffer in the coherent cache.
+ */
+struct mc_coherent_buf {
+	struct list_head list; // link in mpset->coherent_cache
+	dma_addr_t addr; // dma address of the buffer
+};
+
 /**
- * Frees all the chunks associated with the mempool and releases the mempool.
+ * mc_coherent_size_class() - Returns the coherent cache index for given host allocation size.
+ *
+ * @size: allocation size(must be greater than MEMPOOL_KMALLOC_MAX_SIZE)
+ *
+ * Return: size class index, MC_COHERENT_SIZE_CLASSES if the size is too big to be cached.
  */
-static void mp_destroy(struct mempool *mp)
+static int mc_coherent_size_class(u32 size)
 {
-	BUG_ON(mp == NULL);
-	if (!mp->initialized)
-		return;
+	int shift, step_shift;
+	u32 steps;
 
-	if (mp->gen_pool != NULL) {
-		// Free all entries
-		mp_free_device_mem(mp);
-		gen_pool_destroy(mp->gen_pool);
-	}
+	// the classes of shift cover (1 << (shift - 1), 1 << shift] in equal steps
+	if (size <= (1u << (MC_COHERENT_MIN_CLASS_SHIFT - 1)))
+		return 0;
+	shift = order_base_2(size);
+	if (shift > MC_COHERENT_MAX_CLASS_SHIFT)
+		return MC_COHERENT_SIZE_CLASSES;
+	step_shift = shift - 1 - MC_COHERENT_CLASS_STEP_SHIFT;
+	steps = DIV_ROUND_UP(size - (1u << (shift - 1)), 1u << step_shift);
+	return ((shift - MC_COHERENT_MIN_CLASS_SHIFT) << MC_COHERENT_CLASS_STEP_SHIFT) + steps - 1;
 }
 
-int mpset_host_init(struct mempool_set *mpset)
+static u32 mc_coherent_class_size(int size_class)
 {
-	mutex_init(&mpset->lock);
-	INIT_LIST_HEAD(&mpset->host_allocated_head);
-	mpset->root = RB_ROOT;
-	return 0;
+	int shift = MC_COHERENT_MIN_CLASS_SHIFT + (size_class >> MC_COHERENT_CLASS_STEP_SHIFT);
+	u32 steps = (size_class & ((1 << MC_COHERENT_CLASS_STEP_SHIFT) - 1)) + 1;
+
+	return (1u << (shift - 1)) + (steps << (shift - 1 - MC_COHERENT_CLASS_STEP_SHIFT));
 }
 
-int mpset_device_init(struct mempool_set *mpset, int num_channels, int num_regions,
-		      const phys_addr_t device_dram_addr[], const u64 device_dram_size[])
+/**
+ * mc_coherent_alloc_size() - Returns the size actually allocated for a coherent host buffer.
+ */
+static u32 mc_coherent_alloc_size(u32 size)
 {
-	int ret;
-	u32 channel, region;
-	u64 region_sz;
+	int size_class = mc_coherent_size_class(size);
 
-	if (num_regions <= 0 || num_regions > 4)
-		num_regions = 1;
-	mpset->num_regions = num_regions;
+	if (size_class == MC_COHERENT_SIZE_CLASSES)
+		return size;
+	return mc_coherent_class_size(size_class);
+}
 
-	for (channel = 0; channel < num_channels; channel++) {
-		region_sz = device_dram_size[channel] / mpset->num_regions;
-		for (region = 0; region < mpset->num_regions; region++) {
-			dma_addr_t addr = device_dram_addr[channel] + (region * region_sz);
-			ret = mp_init(&mpset->mp_device[channel][region], addr, region_sz,
-				      MEM_LOC_DEVICE, channel, region);
-			if (ret) {
-				pr_err("neuron: mpset device init failed %d\n", ret);
-				goto fail;
-			}
-		}
-	}
+/**
+ * mc_coherent_buf_alloc() - Allocate a coherent host buffer, reusing a cached buffer if possible.
+ * Caller must hold mpset->host_lock.
+ *
+ * @mpset: mpset which owns the cache
+ * @size: allocation size
+ * @addr: dma address of the buffer is returned here
+ * @zero: zero a reused buffer, new buffers are always zeroed
+ *
+ * Return: virtual address of the buffer, NULL on failure.
+ */
+static void *mc_coherent_buf_alloc(struct mempool_set *mpset, u32 size, dma_addr_t *addr,
+				   bool zero)
+{
+	int size_class = mc_coherent_size_class(size);
+	void *va;
 
-	return 0;
+	if (size_class < MC_COHERENT_SIZE_CLASSES && !list_empty(&mpset->coherent_cache[size_class])) {
+		struct mc_coherent_buf *buf = list_first_entry(&mpset->coherent_cache[size_class],
+							       struct mc_coherent_buf, list);
 
-fail:
-	for (; channel >= 0; channel--) {
-		for (; region >= 0; region--) {
-			mp_destroy(&mpset->mp_device[channel][region]);
-		}
+		list_del(&buf->list);
+		mpset->coherent_cache_size -= mc_coherent_class_size(size_class);
+		mpset->coherent_cache_hits++;
+		*addr = buf->addr;
+		va = buf;
+		// the tail past size is visible too once the buffer is mmap()ed
+		if (zero)
+			memset(va, 0, mc_coherent_class_size(size_class));
+		return va;
 	}
-	memset(mpset, 0, sizeof(struct mempool_set));
-
-	return ret;
+	mpset->coherent_cache_misses++;
+	// dma_alloc_coherent() returns zeroed memory
+	return dma_alloc_coherent(mpset->pdev, mc_coherent_alloc_size(size), addr,
+				  GFP_KERNEL | GFP_DMA32);
 }
 
-static void mpset_free_host_memory(struct mempool_set *mpset)
+/**
+ * mc_coherent_buf_free() - Return a buffer allocated by mc_coherent_buf_alloc() to the cache.
+ * Caller must hold mpset->host_lock.
+ */
+static void mc_coherent_buf_free(struct mempool_set *mpset, void *va, dma_addr_t addr, u32 size)
 {
-	struct list_head *this, *next;
-	list_for_each_safe (this, next, &mpset->host_allocated_head) {
-		struct mem_chunk *mc = list_entry(this, struct mem_chunk, host_allocated_list);
-		if (mc->va) {
-			write_lock(&mpset->rblock);
-			mc_remove_node(&mpset->root, mc);
-			write_unlock(&mpset->rblock);
-			if (mc->size > MEMPOOL_KMALLOC_MAX_SIZE) {
-				dma_free_coherent(mpset->pdev, mc->size, mc->va, mc->pa);
-			} else {
-				kfree(mc->va);
-			}
-			mc->va = NULL;
-		}
-		list_del(&mc->host_allocated_list);
-		kfree(mc);
+	int size_class = mc_coherent_size_class(size);
+	u64 cache_max = (u64)mempool_coherent_cache_mb * 1024 * 1024;
+	struct mc_coherent_buf *buf = va;
+
+	if (size_class == MC_COHERENT_SIZE_CLASSES ||
+	    mpset->coherent_cache_size + mc_coherent_class_size(size_class) > cache_max) {
+		dma_free_coherent(mpset->pdev, mc_coherent_alloc_size(size), va, addr);
+		return;
 	}
-	mpset->host_mem_size = 0;
+	buf->addr = addr;
+	list_add(&buf->list, &mpset->coherent_cache[size_class]);
+	mpset->coherent_cache_size += mc_coherent_class_size(size_class);
 }
 
-void mpset_free_all(struct mempool_set *mpset)
+/**
+ * mpset_shrink_coherent_cache() - Release cached coherent buffers, largest first.
+ * Caller must hold mpset->host_lock.
+ *
+ * @mpset: mpset which owns the cache
+ * @nr_pages: number of pages to release
+ *
+ * Return: number of pages released.
+ */
+static unsigned long mpset_shrink_coherent_cache(struct mempool_set *mpset, unsigned long nr_pages)
 {
-	u32 channel, region;
+	unsigned long freed = 0;
+	int i;
 
-	mutex_lock(&mpset->lock);
-	for (channel = 0; channel < V1_MAX_DRAM_CHANNELS; channel++) {
-		for (region = 0; region < mpset->num_regions; region++) {
-			mp_free_device_mem(&mpset->mp_device[channel][region]);
+	for (i = MC_COHERENT_SIZE_CLASSES - 1; i >= 0 && freed < nr_pages; i--) {
+		struct list_head *cache = &mpset->coherent_cache[i];
+		u32 class_size = mc_coherent_class_size(i);
+
+		while (!list_empty(cache) && freed < nr_pages) {
+			struct mc_coherent_buf *buf =
+				list_first_entry(cache, struct mc_coherent_buf, list);
+
+			list_del(&buf->list);
+			dma_free_coherent(mpset->pdev, class_size, buf, buf->addr);
+			mpset->coherent_cache_size -= class_size;
+			freed += class_size >> PAGE_SHIFT;
 		}
 	}
-	mpset_free_host_memory(mpset);
-	mutex_unlock(&mpset->lock);
+	return freed;
 }
 
-void mpset_destroy(struct mempool_set *mpset)
+static struct mempool_set *mpset_from_shrinker(struct shrinker *shrinker)
 {
-	u32 channel, region;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
+	return container_of(shrinker, struct mempool_set, coherent_shrinker_s);
+#else
+	return shrinker->private_data;
+#endif
+}
 
-	mutex_lock(&mpset->lock);
-	for (channel = 0; channel < V1_MAX_DRAM_CHANNELS; channel++) {
-		for (region = 0; region < mpset->num_regions; region++) {
-			mp_destroy(&mpset->mp_device[channel][region]);
-		}
-	}
-	mpset_free_host_memory(mpset);
-	mutex_unlock(&mpset->lock);
-	memset(mpset, 0, sizeof(struct mempool_set));
+static unsigned long mpset_coherent_cache_count(struct shrinker *shrinker,
+						struct shrink_control *sc)
+{
+	struct mempool_set *mpset = mpset_from_shrinker(shrinker);
+
+	return READ_ONCE(mpset->coherent_cache_size) >> PAGE_SHIFT;
 }
 
-struct mem_chunk *mpset_search_mc(struct mempool_set *mp, phys_addr_t pa)
+static unsigned long mpset_coherent_cache_scan(struct shrinker *shrinker,
+					       struct shrink_control *sc)
 {
-	struct rb_node *node = mp->root.rb_node; /* top of the tree */
+	struct mempool_set *mpset = mpset_from_shrinker(shrinker);
+	unsigned long freed;
 
-	while (node) {
-		struct mem_chunk *mc = rb_entry(node, struct mem_chunk, node);
-
-		if ((mc->pa <= pa) && ((mc->pa + mc->size) >= pa)) {
-			return mc;
-		} else if (mc->pa > pa) {
-			node = node->rb_left;
-		} else {
-			node = node->rb_right;
-		}
-	}
-	return NULL;
+	// allocations hold host_lock while calling into the page allocator, don't wait for it.
+	if (!mutex_trylock(&mpset->host_lock))
+		return SHRINK_STOP;
+	freed = mpset_shrink_coherent_cache(mpset, sc->nr_to_scan);
+	mutex_unlock(&mpset->host_lock);
+
+	return freed;
 }
 
-int mc_alloc(struct mempool_set *mpset, struct mem_chunk **result, u32 size,
-	     enum mem_location location, u32 channel, u32 region, u32 nc_id)
+static int mpset_register_shrinker(struct mempool_set *mpset)
 {
-	struct mem_chunk *mc;
-	int ret = 0;
+	struct shrinker *shrinker;
 
-	*result = NULL;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
+	int ret;
 
-	if (channel >= V1_MAX_DRAM_CHANNELS)
-		return -EINVAL;
-#ifdef CONFIG_FAULT_INJECTION
-	if (should_fail(&neuron_fail_mc_alloc, 1))
+	shrinker = &mpset->coherent_shrinker_s;
+	shrinker->count_objects = mpset_coherent_cache_count;
+	shrinker->scan_objects = mpset_coherent_cache_scan;
+	shrinker->seeks = DEFAULT_SEEKS;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 0, 0)
+	ret = register_shrinker(shrinker);
+#else
+	ret = register_shrinker(shrinker, "neuron-coherent-%s", dev_name(mpset->pdev));
+#endif
+	if (ret)
+		return ret;
+#else
+	shrinker = shrinker_alloc(0, "neuron-coherent-%s", dev_name(mpset->pdev));
+	if (shrinker == NULL)
 		return -ENOMEM;
+	shrinker->count_objects = mpset_coherent_cache_count;
+	shrinker->scan_objects = mpset_coherent_cache_scan;
+	shrinker->seeks = DEFAULT_SEEKS;
+	shrinker->private_data = mpset;
+	shrinker_register(shrinker);
 #endif
-	if (mpset->num_regions == 1) // shared DRAM mode, always use region 0
-		region = 0;
+	mpset->coherent_shrinker = shrinker;
+	return 0;
+}
 
-	mc = (struct mem_chunk *)kmalloc(sizeof(struct mem_chunk), GFP_KERNEL);
-	if (mc == NULL)
-		return -ENOMEM;
+static void mpset_unregister_shrinker(struct mempool_set *mpset)
+{
+	if (mpset->coherent_shrinker == NULL)
+		return;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
+	unregister_shrinker(mpset->coherent_shrinker);
+#else
+	shrinker_free(mpset->coherent_shrinker);
+#endif
+	mpset->coherent_shrinker = NULL;
+}
 
-	*result = mc;
-	memset(mc, 0, sizeof(struct mem_chunk));
+/**
+ * Frees the cached host buffers which may hold data of freed chunks, the zeroed pools are kept.
+ * Caller must hold mpset->host_lock.
+ */
+static void mpset_drain_dirty_host_buffers(struct mempool_set *mpset)
+{
+	int i;
 
-	mutex_lock(&mpset->lock);
-	if (location == MEM_LOC_HOST) {
-		if (size > MEMPOOL_KMALLOC_MAX_SIZE) {
-			dma_addr_t addr;
-			mc->va = dma_alloc_coherent(mpset->pdev, size, &addr,
-						    GFP_KERNEL | GFP_DMA32);
-			mc->pa = (phys_addr_t)addr;
-		} else {
-			mc->va = (void *)kmalloc(size, GFP_KERNEL);
-			if (mc->va) {
-				memset(mc->va, 0, size);
-				mc->pa = virt_to_phys(mc->va);
-			}
-		}
-		if (mc->va) {
-			INIT_LIST_HEAD(&mc->host_allocated_list);
-			list_add(&mc->host_allocated_list, &mpset->host_allocated_head);
-			write_lock(&mpset->rblock);
-			mc_insert_node(&mpset->root, mc);
-			write_unlock(&mpset->rblock);
-		} else {
-			pr_info("host mem occupied %lld\n", mpset->host_mem_size);
-		}
-	} else {
-		struct mempool *mp = NULL;
-		mp = &mpset->mp_device[channel][region];
-		if (!mp->gen_pool) {
-			pr_err("neuron: mempool not initialized\n");
-			ret = -ENOMEM;
-			goto exit;
-		}
+	for (i = 0; i < MC_HOST_SIZE_CLASSES; i++)
+		mc_host_freelist_drain(&mpset->host_freelist[i]);
+	mpset_shrink_coherent_cache(mpset, ULONG_MAX);
+}
 
-		mc->va = gen_pool_dma_alloc(mp->gen_pool, size, &mc->pa);
-		if (mc->va) {
-			INIT_LIST_HEAD(&mc->device_allocated_list);
-			list_add(&mc->device_allocated_list, &mp->device_allocated_head);
-		} else {
-			pr_info("%s total %ld occupied %ld needed %d available %ld\n", mp->name,
-				mp->region_size, mp->allocated_size, size,
-				gen_pool_avail(mp->gen_pool));
-			pr_info("device regions %d occupied %lld\n", mpset->num_regions,
-				mpset->device_mem_size);
-		}
-		mp->allocated_size += size;
-	}
-	if (mc->va == NULL) {
-		ret = -ENOMEM;
-		goto exit;
-	}
+/**
+ * Frees all the buffers cached in the host freelists, the zeroed pools and the coherent cache.
+ * Caller must hold mpset->host_lock.
+ */
+static void mpset_drain_host_freelist(struct mempool_set *mpset)
+{
+	int i;
 
-	mc->mpset = mpset;
-	mc->size = size;
-	mc->mem_location = location;
-	mc->dram_channel = channel;
-	mc->dram_region = region;
-	mc->nc_id = nc_id;
+	mpset_drain_dirty_host_buffers(mpset);
+	for (i = 0; i < MC_HOST_SIZE_CLASSES; i++)
+		mc_host_freelist_drain(&mpset->host_zeroed[i]);
+}
 
-	if (location == MEM_LOC_HOST)
-		mpset->host_mem_size += size;
-	else
-		mpset->device_mem_size += size;
+static __always_inline bool mc_range_less(struct latch_tree_node *a, struct latch_tree_node *b)
+{
+	return container_of(a, struct mc_range, node)->pa < container_of(b, struct mc_range, node)->pa;
+}
 
-exit:
-	mutex_unlock(&mpset->lock);
-	if (ret) {
-		kfree(mc);
-		*result = NULL;
-	}
-	return ret;
+static __always_inline int mc_range_comp(void *key, struct latch_tree_node *n)
+{
+	phys_addr_t pa = *(phys_addr_t *)key;
+	struct mc_range *range = container_of(n, struct mc_range, node);
+
+	if (pa < range->pa)
+		return -1;
+	if (pa >= range->pa + range->size)
+		return 1;
+	return 0;
 }
 
-void mc_free(struct mem_chunk **mcp)
+static const struct latch_tree_ops mc_range_ops = {
+	.less = mc_range_less,
+	.comp = mc_range_comp,
+};
+
+/**
+ * mc_index_insert() - Add a host mem chunk to the host index.
+ * Caller must hold mpset->host_lock.
+ */
+static void mc_index_insert(struct mempool_set *mpset, struct mem_chunk *mc)
 {
-	struct mempool_set *mpset;
-	struct mem_chunk *mc = *mcp;
+	u32 i;
 
-	if (mc == NULL)
+	if (mc->sg) {
+		for (i = 0; i < mc->sg->nr_ranges; i++)
+			latch_tree_insert(&mc->sg->ranges[i].node, &mpset->host_index, &mc_range_ops);
 		return;
+	}
+	mc->range.pa = mc->pa;
+	mc->range.size = mc->size;
+	mc->range.mc = mc;
+	latch_tree_insert(&mc->range.node, &mpset->host_index, &mc_range_ops);
+}
 
-	mpset = mc->mpset;
-	mutex_lock(&mpset->lock);
+/**
+ * mc_index_remove() - Remove a host mem chunk from the host index.
+ * Caller must hold mpset->host_lock and must free the chunk with mc_free_rcu().
+ */
+static void mc_index_remove(struct mempool_set *mpset, struct mem_chunk *mc)
+{
+	u32 i;
 
-	if (mc->mem_location == MEM_LOC_HOST) {
-		list_del(&mc->host_allocated_list);
-		write_lock(&mpset->rblock);
-		mc_remove_node(&mpset->root, mc);
-		write_unlock(&mpset->rblock);
-		if (mc->size > MEMPOOL_KMALLOC_MAX_SIZE) {
-			dma_free_coherent(mpset->pdev, mc->size, mc->va, mc->pa);
-		} else {
-			kfree(mc->va);
-			mc->va = NULL;
-		}
-		mpset->host_mem_size -= mc->size;
+	if (mc->sg) {
+		for (i = 0; i < mc->sg->nr_ranges; i++)
+			latch_tree_erase(&mc->sg->ranges[i].node, &mpset->host_index, &mc_range_ops);
+		return;
+	}
+	latch_tree_erase(&mc->range.node, &mpset->host_index, &mc_range_ops);
+}
+
+static void mc_free_rcu_cb(struct rcu_head *head)
+{
+	struct mem_chunk *mc = container_of(head, struct mem_chunk, rcu);
+
+	kfree(mc->sg);
+	kmem_cache_free(mc_cache, mc);
+}
+
+/**
+ * mc_free_rcu() - Free a mem chunk which was in the host index, after concurrent lookups are done.
+ */
+static void mc_free_rcu(struct mem_chunk *mc)
+{
+	call_rcu(&mc->rcu, mc_free_rcu_cb);
+}
+
+static int mp_genpool_init(struct mempool *mp, u64 start_addr, size_t pool_size)
+{
+	int ret;
+
+	mp->gen_pool = gen_pool_create(ilog2(mp->min_alloc_size), -1);
+	if (mp->gen_pool == NULL)
+		return -ENOMEM;
+	ret = gen_pool_add_virt(mp->gen_pool, start_addr, start_addr, pool_size, -1);
+	if (ret) {
+		gen_pool_destroy(mp->gen_pool);
+		mp->gen_pool = NULL;
+		return ret;
+	}
+	return 0;
+}
+
+static void mp_genpool_destroy(struct mempool *mp)
+{
+	gen_pool_destroy(mp->gen_pool);
+	mp->gen_pool = NULL;
+}
+
+static int mp_genpool_alloc(struct mempool *mp, size_t size, u64 *addr)
+{
+	unsigned long va = gen_pool_alloc(mp->gen_pool, size);
+
+	if (va == 0)
+		return -ENOMEM;
+	*addr = va;
+	return 0;
+}
+
+static void mp_genpool_free(struct mempool *mp, u64 addr, size_t size)
+{
+	gen_pool_free(mp->gen_pool, addr, size);
+}
+
+static size_t mp_genpool_alloc_size(struct mempool *mp, size_t size)
+{
+	return ALIGN(size, mp->min_alloc_size);
+}
+
+static const struct mp_allocator_ops mp_genpool_ops = {
+	.name = "genpool",
+	.init = mp_genpool_init,
+	.destroy = mp_genpool_destroy,
+	.alloc = mp_genpool_alloc,
+	.free = mp_genpool_free,
+	.alloc_size = mp_genpool_alloc_size,
+};
+
+static void mp_buddy_insert(struct mp_buddy *buddy, u32 order, struct mp_buddy_block *block)
+{
+	struct rb_node **link = &buddy->free_blocks[order].rb_node, *parent = NULL;
+
+	while (*link) {
+		struct mp_buddy_block *b = rb_entry(*link, struct mp_buddy_block, node);
+
+		parent = *link;
+		if (block->addr < b->addr)
+			link = &(*link)->rb_left;
+		else
+			link = &(*link)->rb_right;
+	}
+	rb_link_node(&block->node, parent, link);
+	rb_insert_color(&block->node, &buddy->free_blocks[order]);
+	buddy->nr_free[order]++;
+}
+
+static void mp_buddy_remove(struct mp_buddy *buddy, u32 order, struct mp_buddy_block *block)
+{
+	rb_erase(&block->node, &buddy->free_blocks[order]);
+	buddy->nr_free[order]--;
+}
+
+static struct mp_buddy_block *mp_buddy_find(struct mp_buddy *buddy, u32 order, u64 addr)
+{
+	struct rb_node *node = buddy->free_blocks[order].rb_node;
+
+	while (node) {
+		struct mp_buddy_block *b = rb_entry(node, struct mp_buddy_block, node);
+
+		if (addr == b->addr)
+			return b;
+		node = addr < b->addr ? node->rb_left : node->rb_right;
+	}
+	return NULL;
+}
+
+/**
+ * mp_buddy_order() - Returns the order of the smallest block which can hold given size.
+ */
+static u32 mp_buddy_order(struct mp_buddy *buddy, size_t size)
+{
+	u32 shift = order_base_2(size);
+
+	return shift <= buddy->min_shift ? 0 : shift - buddy->min_shift;
+}
+
+static void mp_buddy_destroy(struct mempool *mp)
+{
+	struct mp_buddy *buddy = &mp->buddy;
+	u32 order;
+
+	for (order = 0; order < MP_BUDDY_MAX_ORDERS; order++) {
+		struct rb_node *node;
+
+		while ((node = rb_first(&buddy->free_blocks[order])) != NULL) {
+			struct mp_buddy_block *b = rb_entry(node, struct mp_buddy_block, node);
+
+			mp_buddy_remove(buddy, order, b);
+			kmem_cache_free(mp_buddy_block_cache, b);
+		}
+	}
+}
+
+static int mp_buddy_init(struct mempool *mp, u64 start_addr, size_t pool_size)
+{
+	struct mp_buddy *buddy = &mp->buddy;
+	u64 nr_units, unit;
+
+	buddy->base = start_addr;
+	buddy->min_shift = ilog2(mp->min_alloc_size);
+
+	// split the pool into the largest blocks which are aligned(relative to base) to their size.
+	nr_units = pool_size >> buddy->min_shift;
+	for (unit = 0; unit < nr_units;) {
+		struct mp_buddy_block *block;
+		u32 order = ilog2(nr_units - unit);
+
+		if (unit)
+			order = min_t(u32, order, __ffs64(unit));
+		order = min_t(u32, order, MP_BUDDY_MAX_ORDERS - 1);
+
+		block = kmem_cache_alloc(mp_buddy_block_cache, GFP_KERNEL);
+		if (block == NULL) {
+			mp_buddy_destroy(mp);
+			return -ENOMEM;
+		}
+		block->addr = start_addr + (unit << buddy->min_shift);
+		mp_buddy_insert(buddy, order, block);
+		unit += 1ULL << order;
+	}
+	return 0;
+}
+
+static int mp_buddy_alloc(struct mempool *mp, size_t size, u64 *addr)
+{
+	struct mp_buddy *buddy = &mp->buddy;
+	struct mp_buddy_block *split[MP_BUDDY_MAX_ORDERS];
+	struct mp_buddy_block *block;
+	u32 order = mp_buddy_order(buddy, size);
+	u32 cur, i;
+
+	for (cur = order; cur < MP_BUDDY_MAX_ORDERS; cur++) {
+		if (buddy->nr_free[cur])
+			break;
+	}
+	if (cur >= MP_BUDDY_MAX_ORDERS)
+		return -ENOMEM;
+
+	// splitting a block down to the requested order needs a node for every upper half.
+	for (i = 0; i < cur - order; i++) {
+		split[i] = kmem_cache_alloc(mp_buddy_block_cache, GFP_KERNEL);
+		if (split[i] == NULL) {
+			while (i--)
+				kmem_cache_free(mp_buddy_block_cache, split[i]);
+			return -ENOMEM;
+		}
+	}
+
+	// prefer the lowest address to keep the top of the pool free for large blocks.
+	block = rb_entry(rb_first(&buddy->free_blocks[cur]), struct mp_buddy_block, node);
+	mp_buddy_remove(buddy, cur, block);
+	while (cur > order) {
+		cur--;
+		split[cur - order]->addr = block->addr + (1ULL << (cur + buddy->min_shift));
+		mp_buddy_insert(buddy, cur, split[cur - order]);
+	}
+	*addr = block->addr;
+	kmem_cache_free(mp_buddy_block_cache, block);
+	return 0;
+}
+
+static void mp_buddy_free(struct mempool *mp, u64 addr, size_t size)
+{
+	struct mp_buddy *buddy = &mp->buddy;
+	struct mp_buddy_block *block = NULL;
+	u32 order = mp_buddy_order(buddy, size);
+	u64 offset = addr - buddy->base;
+
+	// merge with the buddy as long as it is free, reusing its node for the merged block.
+	while (order < MP_BUDDY_MAX_ORDERS - 1) {
+		u64 block_size = 1ULL << (order + buddy->min_shift);
+		struct mp_buddy_block *b = mp_buddy_find(buddy, order, buddy->base + (offset ^ block_size));
+
+		if (b == NULL)
+			break;
+		mp_buddy_remove(buddy, order, b);
+		if (block)
+			kmem_cache_free(mp_buddy_block_cache, block);
+		block = b;
+		offset &= ~block_size;
+		order++;
+	}
+	if (block == NULL)
+		block = kmem_cache_alloc(mp_buddy_block_cache, GFP_KERNEL | __GFP_NOFAIL);
+	block->addr = buddy->base + offset;
+	mp_buddy_insert(buddy, order, block);
+}
+
+static void mp_buddy_for_each_free(struct mempool *mp, void (*fn)(u64 addr, u64 size, void *data),
+				   void *data)
+{
+	struct mp_buddy *buddy = &mp->buddy;
+	u32 order;
+
+	for (order = 0; order < MP_BUDDY_MAX_ORDERS; order++) {
+		struct rb_node *node;
+
+		for (node = rb_first(&buddy->free_blocks[order]); node; node = rb_next(node)) {
+			struct mp_buddy_block *b = rb_entry(node, struct mp_buddy_block, node);
+
+			fn(b->addr, 1ULL << (order + buddy->min_shift), data);
+		}
+	}
+}
+
+static size_t mp_buddy_alloc_size(struct mempool *mp, size_t size)
+{
+	return (size_t)1 << (mp_buddy_order(&mp->buddy, size) + mp->buddy.min_shift);
+}
+
+static const struct mp_allocator_ops mp_buddy_ops = {
+	.name = "buddy",
+	.init = mp_buddy_init,
+	.destroy = mp_buddy_destroy,
+	.alloc = mp_buddy_alloc,
+	.free = mp_buddy_free,
+	.alloc_size = mp_buddy_alloc_size,
+	.for_each_free = mp_buddy_for_each_free,
+};
+
+struct mp_frag_walk {
+	struct mempool_frag_stats *stats;
+	u32 min_alloc_size;
+};
+
+static void mp_frag_stats_add(u64 addr, u64 size, void *data)
+{
+	struct mp_frag_walk *walk = data;
+	struct mempool_frag_stats *stats = walk->stats;
+	u32 bucket = ilog2(size / walk->min_alloc_size);
+
+	stats->free_size += size;
+	stats->free_extents++;
+	if (size > stats->largest_free)
+		stats->largest_free = size;
+	if (bucket >= MEMPOOL_FRAG_HIST_BUCKETS)
+		bucket = MEMPOOL_FRAG_HIST_BUCKETS - 1;
+	stats->hist[bucket]++;
+}
+
+/**
+ * Same as mp_get_frag_stats(), caller must hold mp->lock.
+ */
+static void __mp_get_frag_stats(struct mempool *mp, struct mempool_frag_stats *stats)
+{
+	struct mp_frag_walk walk = { .stats = stats, .min_alloc_size = mp->min_alloc_size };
+
+	memset(stats, 0, sizeof(*stats));
+	if (mp->ops->for_each_free == NULL) {
+		stats->free_size = mp->region_size - mp->allocated_size;
+		return;
+	}
+	mp->ops->for_each_free(mp, mp_frag_stats_add, &walk);
+}
+
+void mp_get_frag_stats(struct mempool *mp, struct mempool_frag_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	if (!mp->initialized)
+		return;
+	mutex_lock(&mp->lock);
+	__mp_get_frag_stats(mp, stats);
+	mutex_unlock(&mp->lock);
+}
+
+/**
+ * mp_lat_record() - Account an operation which started at @start(ktime_get_ns()) in @hist.
+ * Caller must hold the lock protecting @hist.
+ */
+static void mp_lat_record(struct mempool_lat_hist *hist, u64 start)
+{
+	u64 ns = ktime_get_ns() - start;
+	int bucket = ns ? ilog2(ns) : 0;
+
+	hist->count[min(bucket, MEMPOOL_LAT_HIST_BUCKETS - 1)]++;
+}
+
+/**
+ * mc_slab_class() - Returns the slab size class of a device allocation.
+ *
+ * Return: size class index, -1 if the allocation should not be packed into a slab.
+ */
+static int mc_slab_class(struct mempool *mp, u32 size)
+{
+	if (size > MC_SLAB_MAX_SIZE || size >= mp->min_alloc_size)
+		return -1;
+	if (size <= MC_SLAB_MIN_SIZE)
+		return 0;
+	return order_base_2(size) - MC_SLAB_MIN_SHIFT;
+}
+
+static u32 mc_slab_objects(u32 size_class)
+{
+	return MC_SLAB_SIZE >> (size_class + MC_SLAB_MIN_SHIFT);
+}
+
+/**
+ * mp_slab_alloc() - Allocate an object of given size class, creating a new slab if needed.
+ * Caller must hold mp->lock.
+ *
+ * Return: 0 on success, a negative error code otherwise.
+ */
+static int mp_slab_alloc(struct mempool *mp, int size_class, struct mem_chunk *mc, u64 *addr)
+{
+	struct mc_slab *slab;
+	u32 index;
+	int ret;
+
+	if (list_empty(&mp->slab_partial[size_class])) {
+		slab = kzalloc(sizeof(*slab), GFP_KERNEL);
+		if (slab == NULL)
+			return -ENOMEM;
+		ret = mp->ops->alloc(mp, MC_SLAB_SIZE, &slab->addr);
+		if (ret) {
+			kfree(slab);
+			return ret;
+		}
+		slab->size_class = size_class;
+		slab->nr_free = mc_slab_objects(size_class);
+		list_add(&slab->list, &mp->slab_partial[size_class]);
+		mp->allocated_size += MC_SLAB_SIZE;
+	}
+	slab = list_first_entry(&mp->slab_partial[size_class], struct mc_slab, list);
+	index = find_first_zero_bit(slab->used, mc_slab_objects(size_class));
+	__set_bit(index, slab->used);
+	if (--slab->nr_free == 0)
+		list_move(&slab->list, &mp->slab_full);
+
+	mc->slab = slab;
+	*addr = slab->addr + ((u64)index << (size_class + MC_SLAB_MIN_SHIFT));
+	return 0;
+}
+
+/**
+ * mp_slab_free() - Free the chunk's object, the slab is released when it becomes empty.
+ * Caller must hold mp->lock.
+ */
+static void mp_slab_free(struct mempool *mp, struct mem_chunk *mc)
+{
+	struct mc_slab *slab = mc->slab;
+	u32 index = ((u64)mc->va - slab->addr) >> (slab->size_class + MC_SLAB_MIN_SHIFT);
+
+	__clear_bit(index, slab->used);
+	mc->slab = NULL;
+	if (slab->nr_free++ == 0)
+		list_move(&slab->list, &mp->slab_partial[slab->size_class]);
+	if (slab->nr_free == mc_slab_objects(slab->size_class)) {
+		list_del(&slab->list);
+		mp->ops->free(mp, slab->addr, MC_SLAB_SIZE);
+		mp->allocated_size -= MC_SLAB_SIZE;
+		kfree(slab);
+	}
+}
+
+static void mpset_nc_usage_destroy(struct mempool_set *mpset, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		percpu_counter_destroy(&mpset->nc_usage[i].host_mem_size);
+		percpu_counter_destroy(&mpset->nc_usage[i].device_mem_size);
+	}
+}
+
+static int mpset_nc_usage_init(struct mempool_set *mpset)
+{
+	int i, ret;
+
+	for (i = 0; i < V1_NC_PER_DEVICE; i++) {
+		struct mpset_nc_usage *usage = &mpset->nc_usage[i];
+
+		ret = percpu_counter_init(&usage->host_mem_size, 0, GFP_KERNEL);
+		if (ret)
+			goto fail;
+		ret = percpu_counter_init(&usage->device_mem_size, 0, GFP_KERNEL);
+		if (ret) {
+			percpu_counter_destroy(&usage->host_mem_size);
+			goto fail;
+		}
+		usage->host_mem_limit = 0;
+		usage->device_mem_limit = 0;
+	}
+	return 0;
+
+fail:
+	mpset_nc_usage_destroy(mpset, i);
+	return ret;
+}
+
+/**
+ * mc_nc_charge() - Charge the chunk's size to its NC.
+ *
+ * The counter is incremented first and compared afterwards, so concurrent allocations never
+ * exceed the limit together. percpu_counter_compare() sums the per CPU counts when the value is
+ * close to the limit, so the limit is exact.
+ *
+ * Return: 0 on success, -EDQUOT if the NC would go over its limit.
+ */
+static int mc_nc_charge(struct mem_chunk *mc)
+{
+	struct mpset_nc_usage *usage = &mc->mpset->nc_usage[mc->nc_id];
+	struct percpu_counter *counter;
+	u64 limit;
+
+	if (mc->alloc_flags & MC_ALLOC_NO_CHARGE)
+		return 0;
+	if (mc->mem_location == MEM_LOC_HOST) {
+		counter = &usage->host_mem_size;
+		limit = READ_ONCE(usage->host_mem_limit);
+	} else {
+		counter = &usage->device_mem_size;
+		limit = READ_ONCE(usage->device_mem_limit);
+	}
+	percpu_counter_add(counter, mc->size);
+	if (limit && percpu_counter_compare(counter, limit) > 0) {
+		percpu_counter_sub(counter, mc->size);
+		return -EDQUOT;
+	}
+	return 0;
+}
+
+static void mc_nc_uncharge(struct mem_chunk *mc)
+{
+	struct mpset_nc_usage *usage = &mc->mpset->nc_usage[mc->nc_id];
+
+	if (mc->alloc_flags & MC_ALLOC_NO_CHARGE)
+		return;
+	if (mc->mem_location == MEM_LOC_HOST)
+		percpu_counter_sub(&usage->host_mem_size, mc->size);
+	else
+		percpu_counter_sub(&usage->device_mem_size, mc->size);
+}
+
+/**
+ * mp_init() Initialize the mempool structure with given values.
+ * Creates a backing allocator if the mem_location is device DRAM.
+ *
+ * @mp: pointer to mempool that needs to be initialized
+ * @start_addr: starting address of the pool
+ * @pool_size: size of the pool.
+ * @mem_location: location of the backing memory.
+ * @dram_channel: device dram channel backing this pool(applicable only if mem_location is device).
+ * @dram_region: device dram region backing this pool(applicable only if mem_location is device).
+ * @allocator: backend allocator to use.
+ *
+ * Return: 0 if pool is created, a negative error code otherwise.
+ */
+static int mp_init(struct mempool *mp, u64 start_addr, size_t pool_size,
+		   enum mem_location mem_location, u32 dram_channel, u32 dram_region,
+		   enum mempool_allocator allocator)
+{
+	int i, ret;
+
+	memset(mp, 0, sizeof(*mp));
+
+	mp->mem_location = mem_location;
+	mp->dram_channel = dram_channel;
+	mp->dram_region = dram_region;
+	INIT_LIST_HEAD(&mp->device_allocated_head);
+	for (i = 0; i < MC_SLAB_CLASSES; i++)
+		INIT_LIST_HEAD(&mp->slab_partial[i]);
+	INIT_LIST_HEAD(&mp->slab_full);
+	mutex_init(&mp->lock);
+	init_waitqueue_head(&mp->compact_wq);
+	// host pool chunks are mmap()ed, keep them page aligned
+	mp->min_alloc_size = mem_location == MEM_LOC_HOST ? PAGE_SIZE : mempool_min_alloc_size;
+	if (allocator == MEMPOOL_ALLOCATOR_BUDDY)
+		mp->ops = &mp_buddy_ops;
+	else
+		mp->ops = &mp_genpool_ops;
+
+	// 0 is special since we cant differentiate failure(NULL) in mc->va.
+	// so avoid starting at 0 by sacrificing first chunk.
+	if (start_addr == 0) {
+		start_addr = mp->min_alloc_size;
+		pool_size -= mp->min_alloc_size;
+	}
+	ret = mp->ops->init(mp, start_addr, pool_size);
+	if (ret)
+		return ret;
+
+	if (mem_location == MEM_LOC_HOST)
+		snprintf(mp->name, sizeof(mp->name), "host reserved mempool");
+	else
+		snprintf(mp->name, sizeof(mp->name), "device mempool [%d:%d]", dram_channel,
+			 dram_region);
+	mp->region_size = pool_size;
+	mp->initialized = 1;
+
+	return 0;
+}
+
+/**
+ * Frees all the chunks associated with the mempool.
+ */
+static void mp_free_device_mem(struct mempool *mp)
+{
+	struct list_head *this, *next;
+
+	BUG_ON(mp == NULL);
+	if (!mp->initialized)
+		return;
+
+	mutex_lock(&mp->lock);
+	list_for_each_safe (this, next, &mp->device_allocated_head) {
+		struct mem_chunk *mc = list_entry(this, struct mem_chunk, device_allocated_list);
+		if (mc->va) {
+			// a slab is released with its last object
+			if (mc->slab)
+				mp_slab_free(mp, mc);
+			else
+				mp->ops->free(mp, (u64)mc->va, mc->size);
+			mc->va = NULL;
+			mc_nc_uncharge(mc);
+		}
+		list_del(&mc->device_allocated_list);
+		kmem_cache_free(mc_cache, mc);
+	}
+	mp->allocated_size = 0;
+	mp->nr_chunks = 0;
+	mutex_unlock(&mp->lock);
+}
+
+/**
+ * Frees all the chunks associated with the mempool and releases the mempool.
+ */
+static void mp_destroy(struct mempool *mp)
+{
+	BUG_ON(mp == NULL);
+	if (!mp->initialized)
+		return;
+
+	// Free all entries
+	mp_free_device_mem(mp);
+	mutex_lock(&mp->lock);
+	mp->ops->destroy(mp);
+	mp->initialized = 0;
+	mutex_unlock(&mp->lock);
+}
+
+/**
+ * mpset_host_reserve_init() - Reserve a contiguous host region for large host allocations.
+ *
+ * The region is allocated once at probe, while memory is not yet fragmented, and large host chunks
+ * are sub-allocated from it with the buddy allocator. With CMA enabled dma_alloc_coherent() takes
+ * the region from the CMA area. Failing to reserve is not fatal, large host allocations then fall
+ * back to dma_alloc_coherent() each time.
+ */
+static void mpset_host_reserve_init(struct mempool_set *mpset)
+{
+	size_t size = (size_t)mempool_host_reserve_mb * 1024 * 1024;
+	int ret;
+
+	if (size == 0)
+		return;
+	mpset->host_reserved_va = dma_alloc_coherent(mpset->pdev, size, &mpset->host_reserved_addr,
+						     GFP_KERNEL | GFP_DMA32 | __GFP_NOWARN);
+	if (mpset->host_reserved_va == NULL) {
+		pr_warn("neuron: failed to reserve %d MB of host memory\n", mempool_host_reserve_mb);
+		return;
+	}
+	ret = mp_init(&mpset->host_reserved, mpset->host_reserved_addr, size, MEM_LOC_HOST, 0, 0,
+		      MEMPOOL_ALLOCATOR_BUDDY);
+	if (ret) {
+		pr_warn("neuron: host reserved mempool init failed %d\n", ret);
+		dma_free_coherent(mpset->pdev, size, mpset->host_reserved_va,
+				  mpset->host_reserved_addr);
+		mpset->host_reserved_va = NULL;
+	}
+}
+
+static void mpset_host_reserve_destroy(struct mempool_set *mpset)
+{
+	if (mpset->host_reserved_va == NULL)
+		return;
+	mp_destroy(&mpset->host_reserved);
+	dma_free_coherent(mpset->pdev, mpset->host_reserved.region_size, mpset->host_reserved_va,
+			  mpset->host_reserved_addr);
+	mpset->host_reserved_va = NULL;
+}
+
+/**
+ * mc_host_reserved() - Returns true if the host chunk's memory is from the reserved region.
+ */
+static bool mc_host_reserved(struct mempool_set *mpset, struct mem_chunk *mc)
+{
+	return mpset->host_reserved_va && mc->pa >= mpset->host_reserved_addr &&
+	       mc->pa < mpset->host_reserved_addr + mpset->host_reserved.region_size;
+}
+
+/**
+ * mc_reserved_buf_alloc() - Allocate a host buffer from the reserved region.
+ * Caller must hold mpset->host_lock.
+ *
+ * @mpset: mpset which owns the region
+ * @size: allocation size
+ * @addr: dma address of the buffer is returned here
+ * @zero: zero the buffer
+ *
+ * Return: virtual address of the buffer, NULL if the region is not available or full.
+ */
+static void *mc_reserved_buf_alloc(struct mempool_set *mpset, u32 size, dma_addr_t *addr, bool zero)
+{
+	struct mempool *mp = &mpset->host_reserved;
+	u64 pa;
+	void *va;
+
+	if (mpset->host_reserved_va == NULL)
+		return NULL;
+	mutex_lock(&mp->lock);
+	if (mp->ops->alloc(mp, size, &pa)) {
+		mutex_unlock(&mp->lock);
+		return NULL;
+	}
+	mp->allocated_size += mp->ops->alloc_size(mp, size);
+	mutex_unlock(&mp->lock);
+
+	*addr = pa;
+	va = mpset->host_reserved_va + (pa - mpset->host_reserved_addr);
+	if (zero)
+		memset(va, 0, size);
+	mpset->host_reserved_dirty = true;
+	return va;
+}
+
+/**
+ * mpset_host_reserve_scrub() - Zero the reserved region if it was used.
+ * Caller must hold mpset->host_lock and all chunks of the region must be freed.
+ *
+ * NO_ZERO allocations from the region are not cleared, so it is zeroed before the next owner.
+ */
+static void mpset_host_reserve_scrub(struct mempool_set *mpset)
+{
+	if (mpset->host_reserved_va == NULL || !mpset->host_reserved_dirty)
+		return;
+	memset(mpset->host_reserved_va, 0, mpset->host_reserved.region_size);
+	mpset->host_reserved_dirty = false;
+}
+
+static void mc_reserved_buf_free(struct mempool_set *mpset, dma_addr_t addr, u32 size)
+{
+	struct mempool *mp = &mpset->host_reserved;
+
+	mutex_lock(&mp->lock);
+	mp->ops->free(mp, addr, size);
+	mp->allocated_size -= mp->ops->alloc_size(mp, size);
+	mutex_unlock(&mp->lock);
+}
+
+int mpset_host_init(struct mempool_set *mpset)
+{
+	int i, ret;
+
+	mutex_init(&mpset->host_lock);
+	mutex_init(&mpset->device_pools_lock);
+	init_rwsem(&mpset->relocate_lock);
+	INIT_LIST_HEAD(&mpset->host_allocated_head);
+	for (i = 0; i < MC_HOST_SIZE_CLASSES; i++) {
+		INIT_LIST_HEAD(&mpset->host_freelist[i].head);
+		mpset->host_freelist[i].count = 0;
+		INIT_LIST_HEAD(&mpset->host_zeroed[i].head);
+		mpset->host_zeroed[i].count = 0;
+	}
+	INIT_WORK(&mpset->host_zero_work, mpset_host_zero_work);
+	spin_lock_init(&mpset->placement_lock);
+	mpset->host_zeroed_refill = 0;
+	for (i = 0; i < MC_COHERENT_SIZE_CLASSES; i++)
+		INIT_LIST_HEAD(&mpset->coherent_cache[i]);
+	mpset->coherent_cache_size = 0;
+	atomic64_set(&mpset->host_mem_size, 0);
+	atomic64_set(&mpset->device_mem_size, 0);
+	memset(&mpset->host_index, 0, sizeof(mpset->host_index));
+	atomic64_set(&mpset->host_remote_allocs, 0);
+	mpset->host_node_size = kcalloc(nr_node_ids, sizeof(atomic64_t), GFP_KERNEL);
+	if (mpset->host_node_size == NULL)
+		return -ENOMEM;
+	ret = mpset_nc_usage_init(mpset);
+	if (ret)
+		goto fail_nc_usage;
+	ret = mpset_register_shrinker(mpset);
+	if (ret)
+		goto fail_shrinker;
+	mpset_host_reserve_init(mpset);
+	return 0;
+
+fail_shrinker:
+	mpset_nc_usage_destroy(mpset, V1_NC_PER_DEVICE);
+fail_nc_usage:
+	kfree(mpset->host_node_size);
+	mpset->host_node_size = NULL;
+	return ret;
+}
+
+int mpset_device_init(struct mempool_set *mpset, int num_channels, int num_regions,
+		      const phys_addr_t device_dram_addr[], const u64 device_dram_size[],
+		      enum mempool_allocator allocator)
+{
+	int ret;
+	u32 channel, region;
+	u64 region_sz;
+
+	if (num_regions <= 0 || num_regions > 4)
+		num_regions = 1;
+	mutex_lock(&mpset->device_pools_lock);
+	mpset->num_regions = num_regions;
+
+	for (channel = 0; channel < num_channels; channel++) {
+		region_sz = device_dram_size[channel] / mpset->num_regions;
+		for (region = 0; region < mpset->num_regions; region++) {
+			dma_addr_t addr = device_dram_addr[channel] + (region * region_sz);
+			ret = mp_init(&mpset->mp_device[channel][region], addr, region_sz,
+				      MEM_LOC_DEVICE, channel, region, allocator);
+			if (ret) {
+				pr_err("neuron: mpset device init failed %d\n", ret);
+				goto fail;
+			}
+		}
+	}
+	mutex_unlock(&mpset->device_pools_lock);
+
+	return 0;
+
+fail:
+	// host portion of the mpset stays valid, only undo the device pools.
+	for (channel = 0; channel < V1_MAX_DRAM_CHANNELS; channel++) {
+		for (region = 0; region < MAX_DDR_REGIONS; region++) {
+			mp_destroy(&mpset->mp_device[channel][region]);
+		}
+	}
+	memset(mpset->mp_device, 0, sizeof(mpset->mp_device));
+	mpset->num_regions = 0;
+	mutex_unlock(&mpset->device_pools_lock);
+
+	return ret;
+}
+
+// Huge host chunks are allocated in a single compound page of at least PMD size.
+#define MC_HUGE_MIN_ORDER (PMD_SHIFT - PAGE_SHIFT)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#define MC_HUGE_MAX_ORDER MAX_PAGE_ORDER
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+#define MC_HUGE_MAX_ORDER MAX_ORDER
+#else
+#define MC_HUGE_MAX_ORDER (MAX_ORDER - 1)
+#endif
+
+static unsigned int mc_huge_order(u32 size)
+{
+	return max_t(unsigned int, get_order(size), MC_HUGE_MIN_ORDER);
+}
+
+/**
+ * mc_huge_buf_alloc() - Allocate a zeroed, physically contiguous and PMD aligned host buffer.
+ *
+ * Return: virtual address of the buffer, NULL on failure.
+ */
+static void *mc_huge_buf_alloc(struct mempool_set *mpset, u32 size)
+{
+	struct page *page;
+
+	page = alloc_pages_node(mpset->numa_node, GFP_KERNEL | __GFP_COMP | __GFP_ZERO | __GFP_NOWARN,
+				mc_huge_order(size));
+	if (page == NULL)
+		return NULL;
+	return page_address(page);
+}
+
+u32 mc_huge_max_size(void)
+{
+	return PAGE_SIZE << MC_HUGE_MAX_ORDER;
+}
+
+static void mc_huge_buf_free(void *va, u32 size)
+{
+	__free_pages(virt_to_page(va), mc_huge_order(size));
+}
+
+// Largest block scatter-gather host chunks are built from, bigger blocks mean fewer DMA segments.
+#define MC_SG_MAX_ORDER (PMD_SHIFT - PAGE_SHIFT)
+
+/**
+ * mc_sg_map() - Map pages backing a scatter-gather host chunk for the device and the kernel.
+ *
+ * @mpset: mpset which owns the chunk
+ * @mc: chunk to fill in
+ * @pages: backing pages, owned by the chunk on success
+ * @nr_pages: number of pages
+ * @offset: offset of the chunk in the first page
+ * @size: number of bytes to map starting at @offset
+ *
+ * Return: 0 on success, a negative error code otherwise.
+ */
+static int mc_sg_map(struct mempool_set *mpset, struct mem_chunk *mc, struct page **pages,
+		     u32 nr_pages, u32 offset, unsigned long size)
+{
+	struct scatterlist *s;
+	struct sg_table sgt;
+	struct mc_sg *sg;
+	int nents, ret;
+	void *va;
+	u32 i;
+
+	ret = sg_alloc_table_from_pages(&sgt, pages, nr_pages, offset, size, GFP_KERNEL);
+	if (ret)
+		return ret;
+	nents = dma_map_sg(mpset->pdev, sgt.sgl, sgt.orig_nents, DMA_BIDIRECTIONAL);
+	if (nents == 0) {
+		ret = -ENOMEM;
+		goto fail_table;
+	}
+	sgt.nents = nents;
+	va = vmap(pages, nr_pages, VM_MAP, PAGE_KERNEL);
+	if (va == NULL) {
+		ret = -ENOMEM;
+		goto fail_map;
+	}
+	sg = kmalloc(struct_size(sg, ranges, nents), GFP_KERNEL);
+	if (sg == NULL) {
+		ret = -ENOMEM;
+		goto fail_vmap;
+	}
+	sg->sgt = sgt;
+	sg->pages = pages;
+	sg->nr_pages = nr_pages;
+	sg->nr_ranges = nents;
+	for_each_sg (sgt.sgl, s, nents, i) {
+		sg->ranges[i].pa = sg_dma_address(s);
+		sg->ranges[i].size = sg_dma_len(s);
+		sg->ranges[i].mc = mc;
+	}
+	mc->sg = sg;
+	mc->va = va + offset;
+	mc->pa = sg->ranges[0].pa;
+	return 0;
+
+fail_vmap:
+	vunmap(va);
+fail_map:
+	dma_unmap_sg(mpset->pdev, sgt.sgl, sgt.orig_nents, DMA_BIDIRECTIONAL);
+fail_table:
+	sg_free_table(&sgt);
+	return ret;
+}
+
+/**
+ * mc_sg_buf_alloc() - Back a host chunk with discontiguous pages.
+ *
+ * Pages are allocated in the largest blocks available up to MC_SG_MAX_ORDER and split, so each
+ * page can be freed on its own. Physically contiguous pages end up in the same DMA segment. The
+ * memory is always new, so it is always zeroed.
+ * Caller must hold mpset->host_lock.
+ *
+ * Return: 0 on success, a negative error code otherwise.
+ */
+static int mc_sg_buf_alloc(struct mempool_set *mpset, struct mem_chunk *mc)
+{
+	u32 nr_pages = PAGE_ALIGN(mc->size) >> PAGE_SHIFT;
+	gfp_t gfp = GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN;
+	u32 order = MC_SG_MAX_ORDER;
+	struct page **pages;
+	u32 i = 0, j;
+	int ret;
+
+	// without a wide DMA mask pages above 4GB would be bounced
+	if (dma_get_mask(mpset->pdev) <= DMA_BIT_MASK(32))
+		gfp |= GFP_DMA32;
+	pages = kvmalloc_array(nr_pages, sizeof(*pages), GFP_KERNEL);
+	if (pages == NULL)
+		return -ENOMEM;
+	while (i < nr_pages) {
+		struct page *page;
+
+		order = min_t(u32, order, ilog2(nr_pages - i));
+		page = alloc_pages_node(mpset->numa_node, gfp | (order ? __GFP_NORETRY : 0), order);
+		if (page == NULL) {
+			if (order == 0) {
+				ret = -ENOMEM;
+				goto fail;
+			}
+			order--;
+			continue;
+		}
+		split_page(page, order);
+		for (j = 0; j < (1U << order); j++)
+			pages[i++] = page + j;
+	}
+
+	ret = mc_sg_map(mpset, mc, pages, nr_pages, 0, (unsigned long)nr_pages << PAGE_SHIFT);
+	if (ret)
+		goto fail;
+	return 0;
+
+fail:
+	while (i--)
+		__free_page(pages[i]);
+	kvfree(pages);
+	return ret;
+}
+
+/**
+ * mc_user_lock_account() - Charge or uncharge pinned pages to the locked memory of a process.
+ *
+ * Return: 0 on success, -ENOMEM if charging would exceed RLIMIT_MEMLOCK without CAP_IPC_LOCK.
+ */
+static int mc_user_lock_account(struct mm_struct *mm, u32 nr_pages, bool inc)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 3, 0)
+	return account_locked_vm(mm, nr_pages, inc);
+#else
+	int ret = 0;
+
+	down_write(&mm->mmap_sem);
+	if (!inc) {
+		mm->locked_vm -= min_t(unsigned long, nr_pages, mm->locked_vm);
+	} else if (mm->locked_vm + nr_pages > (rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT) &&
+		   !capable(CAP_IPC_LOCK)) {
+		ret = -ENOMEM;
+	} else {
+		mm->locked_vm += nr_pages;
+	}
+	up_write(&mm->mmap_sem);
+	return ret;
+#endif
+}
+
+/**
+ * mc_user_lock_uncharge() - Undo the charge of mc_user_buf_pin(), mm might belong to a process
+ * which already exited.
+ */
+static void mc_user_lock_uncharge(struct mm_struct *mm, u32 nr_pages)
+{
+	if (mmget_not_zero(mm)) {
+		mc_user_lock_account(mm, nr_pages, false);
+		mmput(mm);
+	}
+	mmdrop(mm);
+}
+
+/**
+ * mc_user_pages_unpin() - Release user pages pinned by mc_user_buf_pin().
+ */
+static void mc_user_pages_unpin(struct page **pages, u32 nr_pages)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+	unpin_user_pages_dirty_lock(pages, nr_pages, true);
+#else
+	u32 i;
+
+	for (i = 0; i < nr_pages; i++) {
+		set_page_dirty_lock(pages[i]);
+		put_page(pages[i]);
+	}
+#endif
+}
+
+/**
+ * mc_user_buf_pin() - Back a host chunk with pinned pages of the calling process.
+ *
+ * The device may write to the pages at any time, so they are pinned writable and long term, and
+ * charged to the locked memory of the process. Must be called without mpset->host_lock, pinning
+ * takes mmap_lock which mpset_mmap() holds when it takes host_lock.
+ *
+ * Return: 0 on success, a negative error code otherwise.
+ */
+static int mc_user_buf_pin(struct mempool_set *mpset, struct mem_chunk *mc, u64 addr)
+{
+	u64 start = addr & PAGE_MASK;
+	u32 offset = addr - start;
+	u32 nr_pages = PAGE_ALIGN(offset + (u64)mc->size) >> PAGE_SHIFT;
+	struct page **pages;
+	long pinned;
+	int ret;
+
+	ret = mc_user_lock_account(current->mm, nr_pages, true);
+	if (ret)
+		return ret;
+	pages = kvmalloc_array(nr_pages, sizeof(*pages), GFP_KERNEL);
+	if (pages == NULL) {
+		ret = -ENOMEM;
+		goto fail_account;
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+	pinned = pin_user_pages_fast(start, nr_pages, FOLL_WRITE | FOLL_LONGTERM, pages);
+#else
+	pinned = get_user_pages_fast(start, nr_pages, FOLL_WRITE, pages);
+#endif
+	if (pinned < 0) {
+		ret = pinned;
+		goto fail_pages;
+	}
+	if (pinned != nr_pages) {
+		ret = -EFAULT;
+		goto fail_pin;
+	}
+	ret = mc_sg_map(mpset, mc, pages, nr_pages, offset, mc->size);
+	if (ret)
+		goto fail_pin;
+	mmgrab(current->mm);
+	mc->sg->mm = current->mm;
+	return 0;
+
+fail_pin:
+	mc_user_pages_unpin(pages, pinned);
+fail_pages:
+	kvfree(pages);
+fail_account:
+	mc_user_lock_account(current->mm, nr_pages, false);
+	return ret;
+}
+
+int mc_user_check(struct mem_chunk *mc)
+{
+	struct mc_sg *sg = mc->sg;
+	struct page **pages;
+	long got;
+	int ret = 0;
+	u32 i;
+
+	if (sg->mm != current->mm)
+		return -EBUSY;
+	pages = kvmalloc_array(sg->nr_pages, sizeof(*pages), GFP_KERNEL);
+	if (pages == NULL)
+		return -ENOMEM;
+	got = get_user_pages_fast(sg->user_addr & PAGE_MASK, sg->nr_pages, FOLL_WRITE, pages);
+	if (got < 0) {
+		ret = got == -EFAULT ? -EBUSY : got;
+		goto done;
+	}
+	if (got != sg->nr_pages)
+		ret = -EBUSY;
+	for (i = 0; i < got; i++) {
+		if (pages[i] != sg->pages[i])
+			ret = -EBUSY;
+		put_page(pages[i]);
+	}
+done:
+	kvfree(pages);
+	return ret;
+}
+
+/**
+ * mc_sg_buf_free() - Release the pages of a scatter-gather host chunk.
+ *
+ * mc->sg itself is freed with the chunk, lockless host index lookups might still use its ranges.
+ */
+static void mc_sg_buf_free(struct mempool_set *mpset, struct mem_chunk *mc)
+{
+	struct mc_sg *sg = mc->sg;
+	u32 i;
+
+	vunmap((void *)((unsigned long)mc->va & PAGE_MASK));
+	dma_unmap_sg(mpset->pdev, sg->sgt.sgl, sg->sgt.orig_nents, DMA_BIDIRECTIONAL);
+	sg_free_table(&sg->sgt);
+	if (mc->alloc_flags & MC_ALLOC_USER) {
+		mc_user_pages_unpin(sg->pages, sg->nr_pages);
+		mc_user_lock_uncharge(sg->mm, sg->nr_pages);
+	} else {
+		for (i = 0; i < sg->nr_pages; i++)
+			__free_page(sg->pages[i]);
+	}
+	kvfree(sg->pages);
+	sg->pages = NULL;
+}
+
+/**
+ * mc_host_node_account() - Account host chunk's memory to the NUMA node backing it.
+ *
+ * @mpset: mpset which owns the chunk
+ * @mc: host memory chunk
+ * @alloc: true when the chunk is allocated, false when freed
+ */
+static void mc_host_node_account(struct mempool_set *mpset, struct mem_chunk *mc, bool alloc)
+{
+	int node;
+
+	// coherent buffers might be remapped, those are not accounted
+	if (!virt_addr_valid(mc->va))
+		return;
+	node = page_to_nid(virt_to_page(mc->va));
+	if (alloc) {
+		atomic64_add(mc->size, &mpset->host_node_size[node]);
+		if (mpset->numa_node != NUMA_NO_NODE && node != mpset->numa_node)
+			atomic64_inc(&mpset->host_remote_allocs);
+	} else {
+		atomic64_sub(mc->size, &mpset->host_node_size[node]);
+	}
+}
+
+/**
+ * mc_host_buf_release() - Release backing host memory of the chunk.
+ * Caller must hold mpset->host_lock.
+ */
+static void mc_host_buf_release(struct mempool_set *mpset, struct mem_chunk *mc)
+{
+	if (mc->alloc_flags & MC_ALLOC_SG)
+		mc_sg_buf_free(mpset, mc);
+	else if (mc->alloc_flags & MC_ALLOC_HUGE)
+		mc_huge_buf_free(mc->va, mc->size);
+	else if (mc_host_reserved(mpset, mc))
+		mc_reserved_buf_free(mpset, mc->pa, mc->size);
+	else if (mc->size > MEMPOOL_KMALLOC_MAX_SIZE)
+		mc_coherent_buf_free(mpset, mc->va, mc->pa, mc->size);
+	else
+		mc_host_buf_free(mpset, mc->va, mc->size);
+	mc->va = NULL;
+}
+
+/**
+ * __mc_host_put() - Drop a reference of a host chunk, its memory is released with the last one.
+ * Caller must hold mpset->host_lock.
+ */
+static void __mc_host_put(struct mempool_set *mpset, struct mem_chunk *mc)
+{
+	u64 start;
+
+	if (!atomic_dec_and_test(&mc->ref_count))
+		return;
+	start = ktime_get_ns();
+	mc_host_node_account(mpset, mc, false);
+	atomic64_sub(mc->size, &mpset->host_mem_size);
+	mc_nc_uncharge(mc);
+	mc_host_buf_release(mpset, mc);
+	mc_free_rcu(mc);
+	mp_lat_record(&mpset->host_free_lat, start);
+}
+
+/**
+ * __mc_host_free() - Remove a host chunk from the mpset and drop its allocation reference.
+ * The memory stays valid until the chunk is unmapped from user space.
+ * Caller must hold mpset->host_lock.
+ */
+static void __mc_host_free(struct mempool_set *mpset, struct mem_chunk *mc)
+{
+	mc_index_remove(mpset, mc);
+	list_del(&mc->host_allocated_list);
+	mpset->host_nr_chunks--;
+	__mc_host_put(mpset, mc);
+}
+
+static void mpset_free_host_memory(struct mempool_set *mpset)
+{
+	struct list_head *this, *next;
+
+	mutex_lock(&mpset->host_lock);
+	list_for_each_safe (this, next, &mpset->host_allocated_head) {
+		struct mem_chunk *mc = list_entry(this, struct mem_chunk, host_allocated_list);
+
+		__mc_host_free(mpset, mc);
+	}
+	mutex_unlock(&mpset->host_lock);
+}
+
+void mpset_free_all(struct mempool_set *mpset)
+{
+	u32 channel, region;
+
+	for (channel = 0; channel < V1_MAX_DRAM_CHANNELS; channel++) {
+		for (region = 0; region < mpset->num_regions; region++) {
+			mp_free_device_mem(&mpset->mp_device[channel][region]);
+		}
+	}
+	atomic64_set(&mpset->device_mem_size, 0);
+	mpset_free_host_memory(mpset);
+	// the next owner must not see this one's data in reused NO_ZERO buffers
+	mutex_lock(&mpset->host_lock);
+	mpset_drain_dirty_host_buffers(mpset);
+	mpset_host_reserve_scrub(mpset);
+	mutex_unlock(&mpset->host_lock);
+}
+
+void mpset_destroy(struct mempool_set *mpset)
+{
+	u32 channel, region;
+
+	for (channel = 0; channel < V1_MAX_DRAM_CHANNELS; channel++) {
+		for (region = 0; region < mpset->num_regions; region++) {
+			mp_destroy(&mpset->mp_device[channel][region]);
+		}
+	}
+	mpset_unregister_shrinker(mpset);
+	mpset_free_host_memory(mpset);
+	cancel_work_sync(&mpset->host_zero_work);
+	mutex_lock(&mpset->host_lock);
+	mpset_drain_host_freelist(mpset);
+	mutex_unlock(&mpset->host_lock);
+	mpset_host_reserve_destroy(mpset);
+	kfree(mpset->host_node_size);
+	mpset_nc_usage_destroy(mpset, V1_NC_PER_DEVICE);
+	memset(mpset, 0, sizeof(struct mempool_set));
+}
+
+struct mc_range *mpset_search_range(struct mempool_set *mpset, phys_addr_t pa)
+{
+	struct latch_tree_node *node;
+
+	node = latch_tree_find(&pa, &mpset->host_index, &mc_range_ops);
+	if (node == NULL)
+		return NULL;
+	return container_of(node, struct mc_range, node);
+}
+
+struct mem_chunk *mpset_search_mc(struct mempool_set *mp, phys_addr_t pa)
+{
+	struct mc_range *range = mpset_search_range(mp, pa);
+
+	return range ? range->mc : NULL;
+}
+
+/**
+ * __mc_host_insert() - Track a host chunk whose backing memory has just been set up.
+ * Caller must hold mpset->host_lock.
+ */
+static void __mc_host_insert(struct mempool_set *mpset, struct mem_chunk *mc)
+{
+	atomic_set(&mc->ref_count, 1);
+	INIT_LIST_HEAD(&mc->host_allocated_list);
+	list_add(&mc->host_allocated_list, &mpset->host_allocated_head);
+	mpset->host_nr_chunks++;
+	mc_index_insert(mpset, mc);
+	mc_host_node_account(mpset, mc, true);
+	atomic64_add(mc->size, &mpset->host_mem_size);
+}
+
+/**
+ * __mc_host_alloc() - Allocate backing host memory for the chunk.
+ * Caller must hold mpset->host_lock.
+ *
+ * @mpset: mpset from which the memory should be allocated
+ * @mc: memory chunk to fill in, mc->size has the allocation size
+ *
+ * Return: 0 if allocation succeeds, a negative error code otherwise.
+ */
+static int __mc_host_alloc(struct mempool_set *mpset, struct mem_chunk *mc)
+{
+	u64 start;
+	int ret;
+
+	ret = mc_nc_charge(mc);
+	if (ret)
+		return ret;
+	start = ktime_get_ns();
+	if (mc->alloc_flags & MC_ALLOC_SG) {
+		if (mc_sg_buf_alloc(mpset, mc))
+			mc->va = NULL;
+	} else if (mc->alloc_flags & MC_ALLOC_HUGE) {
+		mc->va = mc_huge_buf_alloc(mpset, mc->size);
+		if (mc->va)
+			mc->pa = virt_to_phys(mc->va);
+	} else if (mc->size > MEMPOOL_KMALLOC_MAX_SIZE) {
+		bool zero = !(mc->alloc_flags & MC_ALLOC_NO_ZERO);
+		dma_addr_t addr;
+
+		mc->va = mc_reserved_buf_alloc(mpset, mc->size, &addr, zero);
+		if (mc->va == NULL)
+			mc->va = mc_coherent_buf_alloc(mpset, mc->size, &addr, zero);
+		mc->pa = (phys_addr_t)addr;
+	} else {
+		mc->va = mc_host_buf_alloc(mpset, mc->size, !(mc->alloc_flags & MC_ALLOC_NO_ZERO));
+		if (mc->va)
+			mc->pa = virt_to_phys(mc->va);
+	}
+	if (mc->va == NULL) {
+		mp_lat_record(&mpset->host_alloc_lat, start);
+		pr_info("host mem occupied %lld\n", atomic64_read(&mpset->host_mem_size));
+		mc_nc_uncharge(mc);
+		return -ENOMEM;
+	}
+	__mc_host_insert(mpset, mc);
+	mp_lat_record(&mpset->host_alloc_lat, start);
+	return 0;
+}
+
+/**
+ * __mc_device_alloc() - Allocate backing device memory for the chunk from given pool.
+ * Caller must hold mp->lock.
+ *
+ * @mpset: mpset which contains the pool
+ * @mp: device mempool from which the memory should be allocated
+ * @mc: memory chunk to fill in, mc->size has the allocation size
+ *
+ * Return: 0 if allocation succeeds, a negative error code otherwise.
+ */
+static int __mc_device_alloc(struct mempool_set *mpset, struct mempool *mp, struct mem_chunk *mc)
+{
+	u64 addr, start;
+	int slab_class;
+	int ret;
+
+	if (!mp->initialized) {
+		pr_err("neuron: mempool not initialized\n");
+		return -ENOMEM;
+	}
+
+	ret = mc_nc_charge(mc);
+	if (ret)
+		return ret;
+	start = ktime_get_ns();
+	slab_class = mc_slab_class(mp, mc->size);
+	if (slab_class >= 0)
+		ret = mp_slab_alloc(mp, slab_class, mc, &addr);
+	else
+		ret = mp->ops->alloc(mp, mc->size, &addr);
+	mp_lat_record(&mp->alloc_lat, start);
+	if (ret) {
+		struct mempool_frag_stats stats;
+
+		mc_nc_uncharge(mc);
+		__mp_get_frag_stats(mp, &stats);
+		pr_info("%s total %ld occupied %ld needed %d available %lld largest free %lld\n",
+			mp->name, mp->region_size, mp->allocated_size, mc->size, stats.free_size,
+			stats.largest_free);
+		pr_info("device regions %d occupied %lld\n", mpset->num_regions,
+			atomic64_read(&mpset->device_mem_size));
+		return ret;
+	}
+	mc->va = (void *)addr;
+	mc->pa = addr;
+	INIT_LIST_HEAD(&mc->device_allocated_list);
+	list_add(&mc->device_allocated_list, &mp->device_allocated_head);
+	mp->nr_chunks++;
+	if (mc->slab == NULL)
+		mp->allocated_size += mp->ops->alloc_size(mp, mc->size);
+	atomic64_add(mc->size, &mpset->device_mem_size);
+	return 0;
+}
+
+/**
+ * __mc_device_free() - Free backing device memory of the chunk.
+ * Caller must hold mp->lock.
+ */
+static void __mc_device_free(struct mempool_set *mpset, struct mempool *mp, struct mem_chunk *mc)
+{
+	u64 start = ktime_get_ns();
+
+	list_del(&mc->device_allocated_list);
+	mp->nr_chunks--;
+	if (mc->slab) {
+		mp_slab_free(mp, mc);
+	} else {
+		mp->ops->free(mp, (u64)mc->va, mc->size);
+		mp->allocated_size -= mp->ops->alloc_size(mp, mc->size);
+	}
+	mp_lat_record(&mp->free_lat, start);
+	mc->va = NULL;
+	mc_nc_uncharge(mc);
+	atomic64_sub(mc->size, &mpset->device_mem_size);
+}
+
+static struct mempool *mc_device_pool(struct mem_chunk *mc)
+{
+	return &mc->mpset->mp_device[mc->dram_channel][mc->dram_region];
+}
+
+/**
+ * __mc_device_wait_moved() - Wait until mpset_compact() is done with the chunk.
+ * Caller must hold mp->lock, which is dropped while waiting.
+ */
+static void __mc_device_wait_moved(struct mempool *mp, struct mem_chunk *mc)
+{
+	while (mc->moving) {
+		mutex_unlock(&mp->lock);
+		wait_event(mp->compact_wq, !READ_ONCE(mc->moving));
+		mutex_lock(&mp->lock);
+	}
+}
+
+void mc_account_dma(struct mem_chunk *mc, u64 size)
+{
+	if (mc->mem_location == MEM_LOC_DEVICE)
+		atomic64_add(size, &mc_device_pool(mc)->dma_bytes);
+}
+
+// DMA traffic counted for automatic placement halves every MC_PLACEMENT_DECAY.
+#define MC_PLACEMENT_DECAY (HZ / 10)
+
+/**
+ * mp_placement_traffic() - Returns the recent DMA traffic of a pool in bytes.
+ * Caller must hold mpset->placement_lock.
+ */
+static u64 mp_placement_traffic(struct mempool *mp)
+{
+	u64 total = atomic64_read(&mp->dma_bytes);
+	unsigned long now = jiffies;
+
+	if (time_after(now, mp->dma_sample_time + MC_PLACEMENT_DECAY)) {
+		unsigned long periods = (now - mp->dma_sample_time) / MC_PLACEMENT_DECAY;
+		u64 recent = mp->dma_recent + (total - mp->dma_sample_bytes);
+
+		mp->dma_recent = periods >= 64 ? 0 : recent >> periods;
+		mp->dma_sample_bytes = total;
+		mp->dma_sample_time = now;
+	}
+	return mp->dma_recent + (total - mp->dma_sample_bytes);
+}
+
+// Fixed point scale of the placement load terms.
+#define MC_PLACEMENT_SCALE 1024
+
+struct mc_placement {
+	struct mempool *mp;
+	u64 load;
+	bool affine; // pool is in the region of the allocating NC
+};
+
+static bool mc_placement_before(const struct mc_placement *a, const struct mc_placement *b)
+{
+	if (a->affine != b->affine)
+		return a->affine;
+	return a->load < b->load;
+}
+
+/**
+ * mpset_placement_order() - Order the device pools in which a chunk is tried with auto placement.
+ *
+ * @mpset: mpset which owns the pools
+ * @nc_id: NC which allocates the chunk
+ * @order: pools are returned here, must have room for all device pools
+ *
+ * Return: number of pools stored in order.
+ */
+static int mpset_placement_order(struct mempool_set *mpset, u32 nc_id, struct mempool **order)
+{
+	struct mc_placement cand[V1_MAX_DRAM_CHANNELS * MAX_DDR_REGIONS];
+	u64 traffic[V1_MAX_DRAM_CHANNELS * MAX_DDR_REGIONS];
+	u64 traffic_total = 0;
+	u32 channel, region, affine_region;
+	int weight = clamp(mempool_placement_dma_weight, 0, 100);
+	int count = 0, i, j;
+
+	if (mpset->num_regions == 0)
+		return 0;
+	affine_region = nc_id % mpset->num_regions;
+
+	spin_lock(&mpset->placement_lock);
+	for (channel = 0; channel < V1_MAX_DRAM_CHANNELS; channel++) {
+		for (region = 0; region < mpset->num_regions; region++) {
+			struct mempool *mp = &mpset->mp_device[channel][region];
+
+			if (!mp->initialized)
+				continue;
+			cand[count].mp = mp;
+			cand[count].affine = region == affine_region;
+			traffic[count] = mp_placement_traffic(mp);
+			traffic_total += traffic[count];
+			count++;
+		}
+	}
+	spin_unlock(&mpset->placement_lock);
+
+	// bytes and traffic are on different scales, compare the pool's fill ratio and its share of
+	// the recent traffic instead
+	for (i = 0; i < count; i++) {
+		struct mempool *mp = cand[i].mp;
+		u64 fill = div64_u64((u64)READ_ONCE(mp->allocated_size) * MC_PLACEMENT_SCALE,
+				     mp->region_size);
+		u64 share = traffic_total ?
+				    div64_u64(traffic[i] * MC_PLACEMENT_SCALE, traffic_total) : 0;
+
+		cand[i].load = (100 - weight) * fill + weight * share;
+	}
+
+	// insertion sort, there are only a few pools
+	for (i = 1; i < count; i++) {
+		struct mc_placement c = cand[i];
+
+		for (j = i; j > 0 && mc_placement_before(&c, &cand[j - 1]); j--)
+			cand[j] = cand[j - 1];
+		cand[j] = c;
+	}
+	for (i = 0; i < count; i++)
+		order[i] = cand[i].mp;
+	return count;
+}
+
+/**
+ * mc_device_alloc_auto() - Allocate backing device memory from the pool chosen by auto placement.
+ *
+ * Return: 0 if allocation succeeds, a negative error code otherwise.
+ */
+static int mc_device_alloc_auto(struct mempool_set *mpset, struct mem_chunk *mc)
+{
+	struct mempool *order[V1_MAX_DRAM_CHANNELS * MAX_DDR_REGIONS];
+	int count, i, ret = -ENOMEM;
+
+	count = mpset_placement_order(mpset, mc->nc_id, order);
+	for (i = 0; i < count; i++) {
+		struct mempool *mp = order[i];
+
+		mc->dram_channel = mp->dram_channel;
+		mc->dram_region = mp->dram_region;
+		mutex_lock(&mp->lock);
+		ret = __mc_device_alloc(mpset, mp, mc);
+		mutex_unlock(&mp->lock);
+		// the NC's limit is the same in every pool
+		if (ret == 0 || ret == -EDQUOT)
+			break;
+	}
+	return ret;
+}
+
+/**
+ * mc_create() - Validate allocation parameters and create an unbacked memory chunk.
+ *
+ * Return: 0 on success, a negative error code otherwise.
+ */
+static int mc_create(struct mempool_set *mpset, struct mem_chunk **result, u32 size,
+		     enum mem_location location, u32 channel, u32 region, u32 nc_id, u32 flags)
+{
+	struct mem_chunk *mc;
+
+	*result = NULL;
+
+	if ((flags & MC_ALLOC_AUTO_PLACE) && location != MEM_LOC_DEVICE)
+		return -EINVAL;
+	if (flags & MC_ALLOC_AUTO_PLACE) {
+		// placeholders until the pool is chosen
+		channel = 0;
+		region = 0;
+	}
+	if (channel >= V1_MAX_DRAM_CHANNELS)
+		return -EINVAL;
+	if (nc_id >= V1_NC_PER_DEVICE)
+		return -EINVAL;
+	if (location != MEM_LOC_HOST && location != MEM_LOC_DEVICE)
+		return -EINVAL;
+#ifdef CONFIG_FAULT_INJECTION
+	if (should_fail(&neuron_fail_mc_alloc, 1))
+		return -ENOMEM;
+#endif
+	if (mpset->num_regions == 1) // shared DRAM mode, always use region 0
+		region = 0;
+	if (location == MEM_LOC_DEVICE && region >= MAX_DDR_REGIONS)
+		return -EINVAL;
+	if (flags & ~(MC_ALLOC_HUGE | MC_ALLOC_RELOCATABLE | MC_ALLOC_NO_ZERO | MC_ALLOC_AUTO_PLACE |
+		      MC_ALLOC_SG | MC_ALLOC_INTERNAL | MC_ALLOC_NO_CHARGE))
+		return -EINVAL;
+	if ((flags & MC_ALLOC_SG) && (location != MEM_LOC_HOST || (flags & MC_ALLOC_HUGE)))
+		return -EINVAL;
+	if ((flags & MC_ALLOC_RELOCATABLE) && location != MEM_LOC_DEVICE)
+		return -EINVAL;
+	if ((flags & MC_ALLOC_NO_ZERO) && location != MEM_LOC_HOST)
+		return -EINVAL;
+	if ((flags & MC_ALLOC_HUGE) && location != MEM_LOC_HOST)
+		return -EINVAL;
+	if ((flags & MC_ALLOC_HUGE) && mc_huge_order(size) > MC_HUGE_MAX_ORDER)
+		return -E2BIG;
+
+	mc = kmem_cache_zalloc(mc_cache, GFP_KERNEL);
+	if (mc == NULL)
+		return -ENOMEM;
+
+	mc->mpset = mpset;
+	mc->size = size;
+	mc->mem_location = location;
+	mc->dram_channel = channel;
+	mc->dram_region = region;
+	mc->nc_id = nc_id;
+	mc->alloc_flags = flags;
+
+	*result = mc;
+	return 0;
+}
+
+/**
+ * mc_destroy() - Release a memory chunk which has no backing memory.
+ */
+static void mc_destroy(struct mem_chunk *mc)
+{
+	kmem_cache_free(mc_cache, mc);
+}
+
+int mc_alloc(struct mempool_set *mpset, struct mem_chunk **result, u32 size,
+	     enum mem_location location, u32 channel, u32 region, u32 nc_id, u32 flags)
+{
+	struct mem_chunk *mc;
+	int ret;
+
+	ret = mc_create(mpset, &mc, size, location, channel, region, nc_id, flags);
+	if (ret)
+		return ret;
+
+	if (location == MEM_LOC_HOST) {
+		mutex_lock(&mpset->host_lock);
+		ret = __mc_host_alloc(mpset, mc);
+		mutex_unlock(&mpset->host_lock);
+	} else if (flags & MC_ALLOC_AUTO_PLACE) {
+		ret = mc_device_alloc_auto(mpset, mc);
+	} else {
+		struct mempool *mp = mc_device_pool(mc);
+
+		mutex_lock(&mp->lock);
+		ret = __mc_device_alloc(mpset, mp, mc);
+		mutex_unlock(&mp->lock);
+	}
+	if (ret) {
+		mc_destroy(mc);
+		return ret;
+	}
+
+	*result = mc;
+	return 0;
+}
+
+int mc_register_user(struct mempool_set *mpset, struct mem_chunk **result, u64 addr, u32 size,
+		     u32 nc_id)
+{
+	struct mem_chunk *mc;
+	int ret;
+
+	*result = NULL;
+	if (size == 0 || addr + size < addr)
+		return -EINVAL;
+	ret = mc_create(mpset, &mc, size, MEM_LOC_HOST, 0, 0, nc_id, 0);
+	if (ret)
+		return ret;
+	mc->alloc_flags = MC_ALLOC_USER | MC_ALLOC_SG;
+
+	ret = mc_nc_charge(mc);
+	if (ret)
+		goto fail;
+	ret = mc_user_buf_pin(mpset, mc, addr);
+	if (ret) {
+		mc_nc_uncharge(mc);
+		goto fail;
+	}
+	mc->sg->user_addr = addr;
+
+	mutex_lock(&mpset->host_lock);
+	__mc_host_insert(mpset, mc);
+	mutex_unlock(&mpset->host_lock);
+
+	*result = mc;
+	return 0;
+
+fail:
+	mc_destroy(mc);
+	return ret;
+}
+
+int mc_alloc_batch(struct mempool_set *mpset, struct mc_alloc_request *reqs, u32 count)
+{
+	u32 i, channel, region;
+	int ret = 0;
+
+	for (i = 0; i < count; i++) {
+		struct mc_alloc_request *req = &reqs[i];
+
+		ret = mc_create(mpset, &req->mc, req->size, req->location, req->channel,
+				req->region, req->nc_id, req->flags);
+		if (ret)
+			goto fail;
+	}
+
+	// host chunks under one host_lock acquisition
+	mutex_lock(&mpset->host_lock);
+	for (i = 0; i < count && !ret; i++) {
+		if (reqs[i].mc->mem_location == MEM_LOC_HOST)
+			ret = __mc_host_alloc(mpset, reqs[i].mc);
+	}
+	mutex_unlock(&mpset->host_lock);
+	if (ret)
+		goto fail;
+
+	// device chunks under one lock acquisition per pool
+	for (channel = 0; channel < V1_MAX_DRAM_CHANNELS; channel++) {
+		for (region = 0; region < MAX_DDR_REGIONS; region++) {
+			struct mempool *mp = &mpset->mp_device[channel][region];
+			bool locked = false;
+
+			for (i = 0; i < count && !ret; i++) {
+				struct mem_chunk *mc = reqs[i].mc;
+
+				if (mc->mem_location != MEM_LOC_DEVICE ||
+				    (mc->alloc_flags & MC_ALLOC_AUTO_PLACE) || mc_device_pool(mc) != mp)
+					continue;
+				if (!locked) {
+					mutex_lock(&mp->lock);
+					locked = true;
+				}
+				ret = __mc_device_alloc(mpset, mp, mc);
+			}
+			if (locked)
+				mutex_unlock(&mp->lock);
+			if (ret)
+				goto fail;
+		}
+	}
+
+	// auto placed chunks one by one, each placement sees the previous ones
+	for (i = 0; i < count && !ret; i++) {
+		if (reqs[i].mc->alloc_flags & MC_ALLOC_AUTO_PLACE)
+			ret = mc_device_alloc_auto(mpset, reqs[i].mc);
+	}
+	if (ret)
+		goto fail;
+	return 0;
+
+fail:
+	for (i = 0; i < count && reqs[i].mc; i++) {
+		if (reqs[i].mc->va)
+			mc_free(&reqs[i].mc);
+		else
+			mc_destroy(reqs[i].mc);
+		reqs[i].mc = NULL;
+	}
+	return ret;
+}
+
+void mc_free(struct mem_chunk **mcp)
+{
+	struct mempool_set *mpset;
+	struct mem_chunk *mc = *mcp;
+
+	if (mc == NULL)
+		return;
+
+	mpset = mc->mpset;
+
+	if (mc->mem_location == MEM_LOC_HOST) {
+		mutex_lock(&mpset->host_lock);
+		__mc_host_free(mpset, mc);
+		mutex_unlock(&mpset->host_lock);
 	} else if (mc->mem_location == MEM_LOC_DEVICE) {
-		struct mempool *mp;
-		mp = &mpset->mp_device[mc->dram_channel][mc->dram_region];
-		list_del(&mc->device_allocated_list);
-		gen_pool_free(mp->gen_pool, (u64)mc->va, mc->size);
-		mc->va = NULL;
-		mp->allocated_size -= mc->size;
-		mpset->device_mem_size -= mc->size;
+		struct mempool *mp = mc_device_pool(mc);
+
+		mutex_lock(&mp->lock);
+		__mc_device_wait_moved(mp, mc);
+		__mc_device_free(mpset, mp, mc);
+		mutex_unlock(&mp->lock);
+		mc_destroy(mc);
 	} else {
 		BUG();
 	}
 
 	*mcp = NULL;
-	mutex_unlock(&mpset->lock);
+}
+
+void mc_free_batch(struct mem_chunk **mcs, u32 count)
+{
+	struct mempool_set *mpset = NULL;
+	u32 i, channel, region;
+	bool locked = false;
+
+	for (i = 0; i < count && mpset == NULL; i++) {
+		if (mcs[i])
+			mpset = mcs[i]->mpset;
+	}
+	if (mpset == NULL)
+		return;
+
+	// host chunks under one host_lock acquisition
+	for (i = 0; i < count; i++) {
+		if (mcs[i] == NULL || mcs[i]->mem_location != MEM_LOC_HOST)
+			continue;
+		if (!locked) {
+			mutex_lock(&mpset->host_lock);
+			locked = true;
+		}
+		__mc_host_free(mpset, mcs[i]);
+		mcs[i] = NULL;
+	}
+	if (locked)
+		mutex_unlock(&mpset->host_lock);
+
+	// device chunks under one lock acquisition per pool
+	for (channel = 0; channel < V1_MAX_DRAM_CHANNELS; channel++) {
+		for (region = 0; region < MAX_DDR_REGIONS; region++) {
+			struct mempool *mp = &mpset->mp_device[channel][region];
+
+			locked = false;
+			for (i = 0; i < count; i++) {
+				if (mcs[i] == NULL || mc_device_pool(mcs[i]) != mp)
+					continue;
+				if (!locked) {
+					mutex_lock(&mp->lock);
+					locked = true;
+				}
+				__mc_device_wait_moved(mp, mcs[i]);
+				__mc_device_free(mpset, mp, mcs[i]);
+			}
+			if (locked)
+				mutex_unlock(&mp->lock);
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (mcs[i])
+			mc_destroy(mcs[i]);
+		mcs[i] = NULL;
+	}
+}
+
+// objects packed in slabs are never moved, they are small and pin the whole slab anyway
+static bool mc_relocatable(struct mem_chunk *mc)
+{
+	return (mc->alloc_flags & MC_ALLOC_RELOCATABLE) && mc->slab == NULL;
+}
+
+// sort() comparator, orders chunks by descending address
+static int mc_pa_desc_cmp(const void *a, const void *b)
+{
+	const struct mem_chunk *mca = *(const struct mem_chunk **)a;
+	const struct mem_chunk *mcb = *(const struct mem_chunk **)b;
+
+	if (mca->pa == mcb->pa)
+		return 0;
+	return mca->pa < mcb->pa ? 1 : -1;
+}
+
+// Number of chunks mpset_compact() copies between two acquisitions of the pool lock.
+#define MC_COMPACT_BATCH 16
+
+/**
+ * mp_compact_done() - Let frees of chunks picked by mpset_compact() proceed.
+ * Caller must hold mp->lock.
+ */
+static void mp_compact_done(struct mempool *mp, struct mem_chunk **mcs, u32 count)
+{
+	u32 i;
+
+	for (i = 0; i < count; i++)
+		WRITE_ONCE(mcs[i]->moving, false);
+	wake_up_all(&mp->compact_wq);
+}
+
+int mpset_compact(struct mempool_set *mpset, u32 channel, u32 region, mc_copy_fn_t copy,
+		  void *data, u32 *moved_count, u64 *moved_size)
+{
+	struct mempool *mp;
+	struct mem_chunk **mcs = NULL;
+	struct mem_chunk *mc;
+	u64 addrs[MC_COMPACT_BATCH];
+	bool copied[MC_COMPACT_BATCH];
+	u32 count = 0, next = 0, batch, i;
+	int ret = 0;
+
+	*moved_count = 0;
+	*moved_size = 0;
+	if (channel >= V1_MAX_DRAM_CHANNELS || region >= MAX_DDR_REGIONS)
+		return -EINVAL;
+	mp = &mpset->mp_device[channel][region];
+
+	mutex_lock(&mp->lock);
+	if (!mp->initialized)
+		goto done;
+	list_for_each_entry (mc, &mp->device_allocated_head, device_allocated_list) {
+		if (mc_relocatable(mc) && !mc->moving)
+			count++;
+	}
+	if (count == 0)
+		goto done;
+	mcs = kvmalloc_array(count, sizeof(*mcs), GFP_KERNEL);
+	if (mcs == NULL) {
+		ret = -ENOMEM;
+		goto done;
+	}
+	// picked chunks stay allocated until they are moved, see __mc_device_wait_moved()
+	i = 0;
+	list_for_each_entry (mc, &mp->device_allocated_head, device_allocated_list) {
+		if (mc_relocatable(mc) && !mc->moving) {
+			mc->moving = true;
+			mcs[i++] = mc;
+		}
+	}
+	sort(mcs, count, sizeof(*mcs), mc_pa_desc_cmp, NULL);
+
+	while (next < count && ret == 0) {
+		// pick the destinations of a batch, the new range is allocated while the old one is
+		// held, so they never overlap
+		for (batch = 0; next + batch < count && batch < MC_COMPACT_BATCH; batch++) {
+			mc = mcs[next + batch];
+			if (mp->ops->alloc(mp, mc->size, &addrs[batch])) {
+				addrs[batch] = 0;
+			} else if (addrs[batch] >= mc->pa) {
+				mp->ops->free(mp, addrs[batch], mc->size);
+				addrs[batch] = 0;
+			}
+		}
+		mutex_unlock(&mp->lock);
+
+		for (i = 0; i < batch; i++) {
+			mc = mcs[next + i];
+			copied[i] = false;
+			if (addrs[i] && ret == 0) {
+				ret = copy(data, mc, mc->pa, addrs[i], mc->size);
+				copied[i] = ret == 0;
+			}
+		}
+
+		down_write(&mpset->relocate_lock);
+		mutex_lock(&mp->lock);
+		for (i = 0; i < batch; i++) {
+			mc = mcs[next + i];
+			if (addrs[i] == 0)
+				continue;
+			if (!copied[i]) {
+				mp->ops->free(mp, addrs[i], mc->size);
+				continue;
+			}
+			mp->ops->free(mp, mc->pa, mc->size);
+			mc->pa = addrs[i];
+			mc->va = (void *)addrs[i];
+			(*moved_count)++;
+			*moved_size += mc->size;
+		}
+		up_write(&mpset->relocate_lock);
+		mp_compact_done(mp, mcs + next, batch);
+		next += batch;
+	}
+	// chunks after a failed copy stay where they are
+	if (next < count)
+		mp_compact_done(mp, mcs + next, count - next);
+	if (*moved_count)
+		atomic64_inc(&mpset->device_generation);
+
+done:
+	mutex_unlock(&mp->lock);
+	kvfree(mcs);
+	return ret;
+}
+
+void mpset_relocate_lock(struct mempool_set *mpset)
+{
+	down_read(&mpset->relocate_lock);
+}
+
+void mpset_relocate_unlock(struct mempool_set *mpset)
+{
+	up_read(&mpset->relocate_lock);
+}
+
+/**
+ * mc_mappable() - Returns true if the chunk can be mapped to user space.
+ *
+ * Only host chunks which do not share pages with other allocations can be mapped. Registered user
+ * memory is already mapped by its owner. Driver internal chunks are never exposed, the device
+ * trusts their contents(e.g. DMA descriptors).
+ */
+static bool mc_mappable(struct mem_chunk *mc)
+{
+	if (mc->mem_location != MEM_LOC_HOST || (mc->alloc_flags & (MC_ALLOC_USER | MC_ALLOC_INTERNAL)))
+		return false;
+	if ((mc->alloc_flags & (MC_ALLOC_HUGE | MC_ALLOC_SG)) || mc->size > MEMPOOL_KMALLOC_MAX_SIZE)
+		return true;
+	return mc_host_class_size(mc_host_size_class(mc->size)) >= PAGE_SIZE;
+}
+
+int mc_get_mmap_offset(struct mem_chunk *mc, u64 key, u64 *offset)
+{
+	if (!mc_mappable(mc) || key >> MC_MMAP_KEY_BITS)
+		return -EINVAL;
+	*offset = MC_MMAP_START_OFFSET + (key << PAGE_SHIFT);
+	return 0;
+}
+
+static void mc_vm_open(struct vm_area_struct *vma)
+{
+	struct mem_chunk *mc = vma->vm_private_data;
+
+	atomic_inc(&mc->ref_count);
+}
+
+static void mc_vm_close(struct vm_area_struct *vma)
+{
+	struct mem_chunk *mc = vma->vm_private_data;
+	struct mempool_set *mpset = mc->mpset;
+
+	mutex_lock(&mpset->host_lock);
+	__mc_host_put(mpset, mc);
+	mutex_unlock(&mpset->host_lock);
+}
+
+/**
+ * mc_sg_mmap() - Map the pages of a scatter-gather host chunk, one physically contiguous run at a time.
+ */
+static int mc_sg_mmap(struct mem_chunk *mc, struct vm_area_struct *vma, unsigned long size)
+{
+	struct scatterlist *s;
+	unsigned long offset = 0;
+	u32 i;
+	int ret;
+
+	for_each_sg (mc->sg->sgt.sgl, s, mc->sg->sgt.orig_nents, i) {
+		unsigned long len = min_t(unsigned long, s->length, size - offset);
 
-	kfree(mc);
+		if (len == 0)
+			break;
+		ret = remap_pfn_range(vma, vma->vm_start + offset, page_to_pfn(sg_page(s)), len,
+				      vma->vm_page_prot);
+		if (ret)
+			return ret;
+		offset += len;
+	}
+	return 0;
+}
+
+static const struct vm_operations_struct mc_vm_ops = {
+	.open = mc_vm_open,
+	.close = mc_vm_close,
+};
+
+int mpset_mmap(struct mempool_set *mpset, u64 offset, mc_lookup_fn_t lookup, void *data,
+	       struct vm_area_struct *vma)
+{
+	u64 key = (offset - MC_MMAP_START_OFFSET) >> PAGE_SHIFT;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	struct mem_chunk *mc = NULL;
+	int ret;
+
+	// host_lock keeps the chunk from being freed until the mapping holds a reference
+	mutex_lock(&mpset->host_lock);
+	if ((key >> MC_MMAP_KEY_BITS) == 0)
+		mc = lookup(data, key);
+	if (mc == NULL || mc->mpset != mpset || !mc_mappable(mc) || size > PAGE_ALIGN(mc->size)) {
+		ret = -EINVAL;
+		goto done;
+	}
+
+	// the last page is mapped fully, don't expose stale data of a recycled buffer
+	memset(mc->va + mc->size, 0, PAGE_ALIGN(mc->size) - mc->size);
+
+	if (mc->sg) {
+		ret = mc_sg_mmap(mc, vma, size);
+	} else if (mc_host_reserved(mpset, mc)) {
+		// map through the whole region, the DMA API can only map its own allocations
+		vma->vm_pgoff = (mc->pa - mpset->host_reserved_addr) >> PAGE_SHIFT;
+		ret = dma_mmap_coherent(mpset->pdev, vma, mpset->host_reserved_va,
+					mpset->host_reserved_addr, mpset->host_reserved.region_size);
+	} else if (!(mc->alloc_flags & MC_ALLOC_HUGE) && mc->size > MEMPOOL_KMALLOC_MAX_SIZE) {
+		// dma_mmap_coherent() treats vm_pgoff as the offset in the buffer
+		vma->vm_pgoff = 0;
+		ret = dma_mmap_coherent(mpset->pdev, vma, mc->va, mc->pa, size);
+	} else {
+		ret = remap_pfn_range(vma, vma->vm_start, PHYS_PFN(virt_to_phys(mc->va)), size,
+				      vma->vm_page_prot);
+	}
+	if (ret)
+		goto done;
+
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP | VM_DONTCOPY;
+	vma->vm_private_data = mc;
+	vma->vm_ops = &mc_vm_ops;
+	atomic_inc(&mc->ref_count);
+
+done:
+	mutex_unlock(&mpset->host_lock);
+	return ret;
 }
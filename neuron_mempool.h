@@ -7,8 +7,15 @@
  *
  *  1. mem_chunk/mc         - Is a chunk of memory in device/host DRAM.
  *  2. mempool/mp           - Is a pool of memory backed either device DRAM or host DRAM.
- *                            For device memory it uses gen_pool allocator to allocate memory.
- *                            For host memory it directly uses kmalloc().
+ *                            For device memory it uses a pluggable allocator(gen_pool or buddy)
+ *                            to allocate memory. Allocations smaller than the minimum
+ *                            allocation size are packed into shared slabs.
+ *                            For host memory it directly uses kmalloc(); freed host buffers are
+ *                            kept in per size class freelists for reuse. Larger host buffers
+ *                            come from a contiguous region reserved at probe if configured,
+ *                            otherwise from dma_alloc_coherent() and are cached the same way.
+ *                            Host chunks allocated with MC_ALLOC_HUGE use huge pages instead,
+ *                            ones allocated with MC_ALLOC_SG use discontiguous pages.
  *  3. mempool_set/mpset    - Is collection for mp for given neuron device.
  */
 
@@ -16,8 +23,20 @@
 #define NEURON_MEMPOOL_H
 
 #include <linux/types.h>
+#include <linux/atomic.h>
+#include <linux/bitmap.h>
 #include <linux/mutex.h>
+#include <linux/percpu_counter.h>
 #include <linux/rbtree.h>
+#include <linux/rbtree_latch.h>
+#include <linux/rcupdate.h>
+#include <linux/rwsem.h>
+#include <linux/scatterlist.h>
+#include <linux/shrinker.h>
+#include <linux/spinlock.h>
+#include <linux/version.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include "v1/address_map.h"
 
@@ -27,10 +46,100 @@ enum mem_location {
 	MEM_LOC_DEVICE = 2 // Memory chunk is from Device DRAM
 };
 
+// Backend allocators for device memory pools.
+enum mempool_allocator {
+	MEMPOOL_ALLOCATOR_GENPOOL = 0, // first fit bitmap allocator(gen_pool)
+	MEMPOOL_ALLOCATOR_BUDDY = 1, // binary buddy allocator, sizes are rounded up to power of 2
+};
+
+// Maximum number of block orders in buddy allocator.
+#define MP_BUDDY_MAX_ORDERS 32
+
+/** State of buddy allocator.
+ *
+ * Free blocks of each order are kept in a rbtree sorted by address, so that both allocation and
+ * finding the buddy of a freed block are O(log n).
+ */
+struct mp_buddy {
+	u64 base; // address from which buddy alignment is computed
+	u32 min_shift; // log2 of the smallest block size
+	struct rb_root free_blocks[MP_BUDDY_MAX_ORDERS]; // free blocks of each order
+	u32 nr_free[MP_BUDDY_MAX_ORDERS]; // number of blocks in free_blocks
+};
+
+// Device allocations up to MC_SLAB_MAX_SIZE and smaller than the pool's min_alloc_size are packed
+// into shared slabs, in power of 2 size classes starting at MC_SLAB_MIN_SIZE.
+#define MC_SLAB_MIN_SHIFT 3
+#define MC_SLAB_MAX_SHIFT 8
+#define MC_SLAB_MIN_SIZE (1 << MC_SLAB_MIN_SHIFT)
+#define MC_SLAB_MAX_SIZE (1 << MC_SLAB_MAX_SHIFT)
+#define MC_SLAB_CLASSES (MC_SLAB_MAX_SHIFT - MC_SLAB_MIN_SHIFT + 1)
+// Size of device memory backing one slab.
+#define MC_SLAB_SIZE 4096
+#define MC_SLAB_MAX_OBJECTS (MC_SLAB_SIZE / MC_SLAB_MIN_SIZE)
+
+/** A slab of device memory holding objects of one size class.
+ *
+ * Each object still has its own mem_chunk, so it has a regular handle and pa.
+ */
+struct mc_slab {
+	struct list_head list; // link in mempool->slab_partial or mempool->slab_full
+	u64 addr; // device address of the slab
+	u32 size_class; // index of the object size class
+	u32 nr_free; // number of free objects
+	DECLARE_BITMAP(used, MC_SLAB_MAX_OBJECTS); // allocated objects
+};
+
+struct mempool;
+
+/** Operations of a device memory pool backend allocator.
+ *
+ * All the operations except init are called with mp->lock held.
+ */
+struct mp_allocator_ops {
+	const char *name;
+	int (*init)(struct mempool *mp, u64 start_addr, size_t pool_size);
+	void (*destroy)(struct mempool *mp);
+	int (*alloc)(struct mempool *mp, size_t size, u64 *addr);
+	void (*free)(struct mempool *mp, u64 addr, size_t size);
+	// bytes alloc() takes from the pool for an allocation of size
+	size_t (*alloc_size)(struct mempool *mp, size_t size);
+	// calls fn() for each free extent in the pool, optional
+	void (*for_each_free)(struct mempool *mp, void (*fn)(u64 addr, u64 size, void *data),
+			      void *data);
+};
+
+// Number of buckets in free block histogram.
+#define MEMPOOL_FRAG_HIST_BUCKETS 32
+
+/** Fragmentation stats of a device memory pool.
+ *
+ * Only free_size is known if the allocator has no for_each_free(), the other fields are 0.
+ */
+struct mempool_frag_stats {
+	u64 free_size; // total free bytes
+	u64 largest_free; // size of the largest free extent
+	u64 free_extents; // number of free extents
+	// number of free extents of size [min_alloc_size << i, min_alloc_size << (i + 1))
+	u32 hist[MEMPOOL_FRAG_HIST_BUCKETS];
+};
+
+// Number of buckets in alloc/free latency histogram.
+#define MEMPOOL_LAT_HIST_BUCKETS 24
+
+/** Alloc or free latency histogram of a pool.
+ *
+ * Bucket i counts operations which took [2^i, 2^(i + 1)) ns, the last bucket counts everything
+ * slower. Updated with the pool's lock held.
+ */
+struct mempool_lat_hist {
+	u64 count[MEMPOOL_LAT_HIST_BUCKETS];
+};
+
 /** Memory pool to manage Device memory.
  *
  * Device is memory is split in to chunks and allocated.
- * Uses genpool allocator in the backend.
+ * Uses gen_pool or buddy allocator in the backend.
  */
 struct mempool {
 	char name[32]; // friendly name
@@ -40,35 +149,161 @@ struct mempool {
 	u32 dram_channel; // DRAM channel valid only if location is device
 	u32 dram_region; // DRAM region valid only if location is device
 
-	struct gen_pool *gen_pool; // backing gen_pool allocator
+	const struct mp_allocator_ops *ops; // backend allocator
+	struct gen_pool *gen_pool; // backing gen_pool allocator, valid only for genpool backend
+	struct mp_buddy buddy; // buddy allocator state, valid only for buddy backend
+	u32 min_alloc_size; // allocation granularity of the pool
 
+	struct mutex lock; // protects device_allocated_head, slabs and allocated_size
 	struct list_head device_allocated_head; // list of allocated chunks
+	struct list_head slab_partial[MC_SLAB_CLASSES]; // slabs which have free objects
+	struct list_head slab_full; // slabs which have no free objects
 
 	size_t region_size; // size of the initial region
-	size_t allocated_size; // total allocated memory size in bytes
+	size_t allocated_size; // memory allocated from the backend in bytes, slabs included
+	u64 nr_chunks; // number of chunks in device_allocated_head
+	struct mempool_lat_hist alloc_lat; // latency of chunk allocations
+	struct mempool_lat_hist free_lat; // latency of chunk frees
+
+	atomic64_t dma_bytes; // bytes copied to/from the pool by driver initiated DMA
+	// DMA traffic samples for automatic placement, protected by mpset->placement_lock
+	u64 dma_sample_bytes; // dma_bytes when dma_recent was last decayed
+	u64 dma_recent; // decayed DMA traffic before the last sample
+	unsigned long dma_sample_time; // jiffies of the last sample
+
+	wait_queue_head_t compact_wq; // woken when mpset_compact() is done moving chunks
 };
 
 // DRAM region is split into multiple regions.
 #define MAX_DDR_REGIONS 4
 
+// Limit for using kmalloc
+#define MEMPOOL_KMALLOC_MAX_SIZE (256 * 1024)
+
+// Host allocations up to MEMPOOL_KMALLOC_MAX_SIZE are rounded up to a power of 2 size class.
+#define MC_HOST_MIN_CLASS_SHIFT 6
+#define MC_HOST_MAX_CLASS_SHIFT 18
+#define MC_HOST_SIZE_CLASSES (MC_HOST_MAX_CLASS_SHIFT - MC_HOST_MIN_CLASS_SHIFT + 1)
+
+// Size classes from this one(PAGE_SIZE) up have a pool of pre-zeroed buffers.
+#define MC_HOST_ZEROED_MIN_CLASS (PAGE_SHIFT - MC_HOST_MIN_CLASS_SHIFT)
+
+/** Freed host buffers of one size class.
+ *
+ * The list is threaded through the free buffers themselves, so no memory is needed to track them.
+ */
+struct mc_host_freelist {
+	struct list_head head; // list of free buffers
+	u32 count; // number of buffers in the list
+};
+
+// Coherent host allocations above MEMPOOL_KMALLOC_MAX_SIZE are rounded up to a size class, buffers
+// up to 1 << MC_COHERENT_MAX_CLASS_SHIFT are cached when freed. Each power of 2 range is split in
+// 1 << MC_COHERENT_CLASS_STEP_SHIFT classes so that buffers of close sizes can share a cache. This
+// does not bound the memory used: dma_direct rounds the backing allocation of each class up to
+// get_order(size), a power of 2 number of pages.
+#define MC_COHERENT_MIN_CLASS_SHIFT 19
+#define MC_COHERENT_MAX_CLASS_SHIFT 26
+#define MC_COHERENT_CLASS_STEP_SHIFT 2
+#define MC_COHERENT_SIZE_CLASSES                                                                   \
+	((MC_COHERENT_MAX_CLASS_SHIFT - MC_COHERENT_MIN_CLASS_SHIFT + 1) << MC_COHERENT_CLASS_STEP_SHIFT)
+
+/** Memory usage and limits of one NeuronCore.
+ *
+ * Chunks are charged to the NC given at allocation time. A limit of 0 means no limit.
+ */
+struct mpset_nc_usage {
+	struct percpu_counter host_mem_size; // host memory used by the NC
+	struct percpu_counter device_mem_size; // device memory used by the NC
+	u64 host_mem_limit; // max host memory the NC can use
+	u64 device_mem_limit; // max device memory the NC can use
+};
+
+/** Collection of memory pools of a device.
+ *
+ * Each device pool has its own lock, so allocations from different DRAM channels/regions and
+ * host allocations do not serialize on each other.
+ */
 struct mempool_set {
-	struct mutex lock;
 	u32 num_regions; // number of regions in the device pool
 	struct mempool mp_device[V1_MAX_DRAM_CHANNELS][MAX_DDR_REGIONS]; // device memory pools
+	// held by mpset_device_init() and by stats readers walking all of mp_device
+	struct mutex device_pools_lock;
 
+	struct mutex host_lock; // protects host_allocated_head, the host caches and their stats
 	struct list_head host_allocated_head; // list of allocated host memory
+	struct mc_host_freelist host_freelist[MC_HOST_SIZE_CLASSES]; // freed kmalloc'd host buffers
+	struct mc_host_freelist host_zeroed[MC_HOST_SIZE_CLASSES]; // zeroed buffers, refilled by host_zero_work
+	struct work_struct host_zero_work; // zeroes freed buffers and refills host_zeroed
+	unsigned long host_zeroed_refill; // bitmap of size classes whose host_zeroed is refilled
+	struct list_head coherent_cache[MC_COHERENT_SIZE_CLASSES]; // freed coherent host buffers
+	u64 coherent_cache_size; // total bytes held in coherent_cache
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
+	struct shrinker coherent_shrinker_s; // storage for coherent_shrinker on older kernels
+#endif
+	struct shrinker *coherent_shrinker; // releases coherent_cache under memory pressure
 
 	// for stats and debugging
-	u64 host_mem_size; // host memory used
-	u64 device_mem_size; // device memory used
+	atomic64_t host_mem_size; // host memory used
+	atomic64_t device_mem_size; // device memory used
+	u64 host_freelist_hits; // host allocations served from host_freelist
+	u64 host_freelist_misses; // host allocations which had to kmalloc
+	u64 host_zeroed_hits; // host allocations served from host_zeroed
+	u64 host_nr_chunks; // number of chunks in host_allocated_head
+	struct mempool_lat_hist host_alloc_lat; // latency of host chunk allocations
+	struct mempool_lat_hist host_free_lat; // latency of host chunk frees
+	u64 coherent_cache_hits; // coherent allocations served from coherent_cache
+	u64 coherent_cache_misses; // coherent allocations which had to dma_alloc_coherent
+
+	// contiguous host region reserved at probe, large host chunks are allocated from it first
+	struct mempool host_reserved; // buddy allocator over the region, valid if host_reserved_va
+	void *host_reserved_va; // virtual address of the region, NULL if nothing is reserved
+	dma_addr_t host_reserved_addr; // dma address of the region
+	bool host_reserved_dirty; // region was handed out since it was last zeroed, under host_lock
 
 	void *pdev; // pci_dev->dev pointer
-	struct rb_root root; //rbtree that has all host mem chunks allocated
-	rwlock_t rblock; //protect the rbtree access
+	int numa_node; // NUMA node host memory is allocated from(NUMA_NO_NODE for any)
+	atomic64_t *host_node_size; // host memory used on each NUMA node, nr_node_ids entries
+	atomic64_t host_remote_allocs; // host allocations which ended up on a node other than numa_node
+	atomic64_t device_generation; // incremented by each mpset_compact() which moved a chunk
+	// held for read while the pa of device chunks is used, for write by mpset_compact() to change it
+	struct rw_semaphore relocate_lock;
+	struct mpset_nc_usage nc_usage[V1_NC_PER_DEVICE]; // per NC usage, allocations over a limit fail
+	spinlock_t placement_lock; // protects DMA traffic samples of the device pools
+	// index of allocated host memory by physical address, modified with host_lock held and
+	// searched locklessly under rcu_read_lock().
+	struct latch_tree_root host_index;
+};
+
+struct mem_chunk;
+
+/** Entry in the host memory index, covers physical range [pa, pa + size).
+ */
+struct mc_range {
+	struct latch_tree_node node; // link in mpset->host_index
+	phys_addr_t pa; // start of the range
+	u64 size; // size of the range
+	struct mem_chunk *mc; // chunk which owns the range
+};
+
+/** Backing memory of a scatter-gather host chunk.
+ *
+ * The pages are mapped contiguously at mc->va for the kernel, the device sees them as the DMA
+ * segments in ranges.
+ */
+struct mc_sg {
+	struct sg_table sgt; // DMA mapped scatter list of the pages
+	struct page **pages; // backing pages
+	u32 nr_pages; // number of entries in pages
+	u32 nr_ranges; // number of DMA segments
+	u64 user_addr; // MC_ALLOC_USER chunks only, user address the pages are pinned from
+	struct mm_struct *mm; // MC_ALLOC_USER chunks only, mm the pinned pages are charged to
+	struct mc_range ranges[]; // DMA segments, in chunk offset order, all are in the host index
 };
 
 struct mem_chunk {
-	struct rb_node node; // valid when this chunk is added to the rbtree
+	struct mc_range range; // valid when this chunk(unless scatter-gather) is added to the host index
+	struct rcu_head rcu; // used to defer freeing of host chunks past lockless index lookups
 	phys_addr_t pa; // physical address of the chunk
 	void *va; // virtual address of the chunk
 
@@ -79,6 +314,12 @@ struct mem_chunk {
 	u32 dram_channel; // DRAM channel
 	u32 dram_region; // TDRAM region
 	u32 nc_id; //neuron core index
+	u32 alloc_flags; // MC_ALLOC_* flags the chunk was allocated with
+	atomic_t ref_count; // host chunks only, allocation reference plus one per user mapping
+	u32 handle_gen; // generation tag of the user space handle of the chunk
+	struct mc_slab *slab; // device chunks only, slab the chunk is packed in or NULL
+	bool moving; // device chunks only, picked by mpset_compact() which has not moved it yet
+	struct mc_sg *sg; // host chunks allocated with MC_ALLOC_SG only
 
 	enum mem_location mem_location; // location of memory - Host or Device
 
@@ -93,10 +334,23 @@ struct mc_list {
 	struct mem_chunk *tail;
 };
 
+/**
+ * mempool_module_init() - Create the caches used by all the mempool sets.
+ *
+ * Return: 0 on success, a negative error code otherwise.
+ */
+int mempool_module_init(void);
+
+/**
+ * mempool_module_exit() - Destroy the caches created by mempool_module_init().
+ */
+void mempool_module_exit(void);
+
 /**
  * mpset_host_init() - Initialize the mpset for host memory allocation.
  *
- * @mpset: Pointer to mpset which need to be initialized
+ * @mpset: Pointer to mpset which need to be initialized, mpset->pdev and mpset->numa_node must
+ *         already be set
  *
  * Return: 0 if initialization succeeds, a negative error code otherwise.
  */
@@ -110,11 +364,21 @@ int mpset_host_init(struct mempool_set *mpset);
  * @num_regions: Number of regions inside each DRAM channel
  * @device_dram_addr: Array of start addresses of DRAM channel
  * @device_dram_size: Array of size of each DRAM channel
+ * @allocator: Backend allocator used by the device memory pools
  *
  * Return: 0 if initialization succeeds, a negative error code otherwise.
  */
 int mpset_device_init(struct mempool_set *mpset, int num_channels, int num_regions,
-		      const phys_addr_t device_dram_addr[], const u64 device_dram_size[]);
+		      const phys_addr_t device_dram_addr[], const u64 device_dram_size[],
+		      enum mempool_allocator allocator);
+
+/**
+ * mp_get_frag_stats() - Get fragmentation stats of a device memory pool.
+ *
+ * @mp: device memory pool
+ * @stats: stats are returned here
+ */
+void mp_get_frag_stats(struct mempool *mp, struct mempool_frag_stats *stats);
 
 /** Free up all host and device memory in the mpset.
  *
@@ -129,7 +393,23 @@ void mpset_free_all(struct mempool_set *mp);
  */
 void mpset_destroy(struct mempool_set *mp);
 
-/** mpset_search_mc() - Find memory chunk which maps given physical address
+/** mpset_search_range() - Find the host index entry which covers given physical address.
+ *
+ * A scatter-gather host chunk has one entry per DMA segment, other chunks have one entry.
+ * Caller must be in rcu_read_lock() section, the returned entry can be freed as soon as the
+ * section ends.
+ *
+ * @mpset: Pointer to mpset
+ * @pa: physical address to search
+ *
+ * Return: the entry which covers pa on success, NULL on failure
+ */
+struct mc_range *mpset_search_range(struct mempool_set *mpset, phys_addr_t pa);
+
+/** mpset_search_mc() - Find host memory chunk which maps given physical address
+ *
+ * Caller must be in rcu_read_lock() section, the returned chunk can be freed as soon as the
+ * section ends.
  *
  * @mpset: Pointer to mpset
  * @pa: physical address to search
@@ -138,6 +418,26 @@ void mpset_destroy(struct mempool_set *mp);
  */
 struct mem_chunk *mpset_search_mc(struct mempool_set *mp, phys_addr_t pa);
 
+// mc_alloc() flags
+// back host chunk with physically contiguous huge(PMD size) pages, up to mc_huge_max_size() bytes
+#define MC_ALLOC_HUGE (1 << 0)
+#define MC_ALLOC_RELOCATABLE (1 << 1) // device chunk may be moved by mpset_compact()
+// host chunk is fully written before being read, a reused buffer is not zeroed. Memory new to the
+// mpset is always zeroed and cached buffers are dropped in mpset_free_all(), so a chunk can only
+// see stale data of the current owner.
+#define MC_ALLOC_NO_ZERO (1 << 2)
+// device chunk's channel and region are chosen by the driver, see mc_alloc()
+#define MC_ALLOC_AUTO_PLACE (1 << 3)
+// back host chunk with discontiguous pages, the device sees them as the DMA segments in mc->sg
+#define MC_ALLOC_SG (1 << 4)
+// host chunk is pinned user memory, set by mc_register_user() only
+#define MC_ALLOC_USER (1 << 5)
+// host chunk is used by the driver itself(rings, queues, bounce buffers) and is never mapped to
+// user space with mpset_mmap()
+#define MC_ALLOC_INTERNAL (1 << 6)
+// chunk is shared by all NCs and not charged to nc_id's usage or limit
+#define MC_ALLOC_NO_CHARGE (1 << 7)
+
 /**
  * mc_alloc() - Allocate a memory chunk of size from given mpset.
  *
@@ -147,11 +447,95 @@ struct mem_chunk *mpset_search_mc(struct mempool_set *mp, phys_addr_t pa);
  * @location: Backing DRAM location(host/device)
  * @channel: Backing DRAM channel
  * @region: Region in the backing DRAM
+ * @nc_id: Neuron core which uses the chunk, the chunk is charged to its usage
+ * @flags: MC_ALLOC_* flags
  *
- * Return: 0 if allocation succeeds, a negative error code otherwise.
+ * With MC_ALLOC_AUTO_PLACE channel and region are ignored. The pools in the region of the NC
+ * (nc_id % num_regions) are tried first, then the others; within each group pools are tried from
+ * the least loaded. The load mixes the fraction of the pool which is allocated and the pool's
+ * share of the recent DMA traffic of all pools, weighted by mempool_placement_dma_weight. The
+ * chosen placement is stored in the chunk's dram_channel and dram_region.
+ *
+ * Return: 0 if allocation succeeds, -EDQUOT if it would exceed the NC's limit, -E2BIG if a
+ * MC_ALLOC_HUGE chunk is larger than mc_huge_max_size(), a negative error code otherwise.
  */
 int mc_alloc(struct mempool_set *mpset, struct mem_chunk **result, u32 size,
-	     enum mem_location location, u32 channel, u32 region, u32 nc_id);
+	     enum mem_location location, u32 channel, u32 region, u32 nc_id, u32 flags);
+
+/**
+ * mc_huge_max_size() - Largest chunk which can be allocated with MC_ALLOC_HUGE.
+ *
+ * A huge chunk is a single physically contiguous allocation of the page allocator, so it is
+ * limited by its largest order(4MB on x86 by default).
+ */
+u32 mc_huge_max_size(void);
+
+/** Parameters and result of one allocation in mc_alloc_batch().
+ */
+struct mc_alloc_request {
+	u32 size; // [in] allocation size
+	enum mem_location location; // [in] backing DRAM location(host/device)
+	u32 channel; // [in] backing DRAM channel
+	u32 region; // [in] region in the backing DRAM
+	u32 nc_id; // [in] neuron core index
+	u32 flags; // [in] MC_ALLOC_* flags
+	struct mem_chunk *mc; // [out] allocated memory chunk
+};
+
+/**
+ * mc_alloc_batch() - Allocate multiple memory chunks from given mpset.
+ *
+ * Each backing pool is locked only once for the whole batch.
+ * Either all the chunks are allocated or none.
+ *
+ * @mpset: mpset from which the chunks should be allocated
+ * @reqs: allocation requests, allocated chunks are returned in reqs[i].mc
+ * @count: number of requests
+ *
+ * Return: 0 if all allocations succeed, a negative error code otherwise.
+ */
+int mc_alloc_batch(struct mempool_set *mpset, struct mc_alloc_request *reqs, u32 count);
+
+/**
+ * mc_register_user() - Pin a user buffer of the calling process and make it a host chunk.
+ *
+ * The chunk is a scatter-gather chunk (MC_ALLOC_USER | MC_ALLOC_SG), so the device can DMA
+ * directly to and from the buffer. It can not be mapped with mpset_mmap(). The pages stay pinned
+ * until the chunk is freed with mc_free(), they are charged to the locked memory of the process
+ * (RLIMIT_MEMLOCK) unless it has CAP_IPC_LOCK.
+ *
+ * @mpset: mpset which owns the chunk
+ * @result: Buffer to store the memory chunk pointer
+ * @addr: user address of the buffer
+ * @size: size of the buffer
+ * @nc_id: Neuron core which uses the chunk, the chunk is charged to its usage
+ *
+ * Return: 0 on success, -EFAULT if the buffer is not fully mapped, -EDQUOT if it would exceed
+ * the NC's limit, -ENOMEM if it would exceed RLIMIT_MEMLOCK, a negative error code otherwise.
+ */
+int mc_register_user(struct mempool_set *mpset, struct mem_chunk **result, u64 addr, u32 size,
+		     u32 nc_id);
+
+/**
+ * mc_user_check() - Check that a registered user buffer is still backed by its pinned pages.
+ *
+ * The buffer might have been unmapped and its address reused since it was registered, the
+ * chunk then still refers to the old pages.
+ *
+ * @mc: chunk returned by mc_register_user()
+ *
+ * Return: 0 if the user address still maps the chunk's pages in the calling process, -EBUSY if
+ * it does not, a negative error code otherwise.
+ */
+int mc_user_check(struct mem_chunk *mc);
+
+/**
+ * mc_account_dma() - Record DMA traffic to/from a chunk, used for automatic placement.
+ *
+ * @mc: chunk which was copied to or from
+ * @size: number of bytes copied
+ */
+void mc_account_dma(struct mem_chunk *mc, u64 size);
 
 /**
  * mc_free() - Free memory chunk and associated backing memory.
@@ -160,4 +544,101 @@ int mc_alloc(struct mempool_set *mpset, struct mem_chunk **result, u32 size,
  */
 void mc_free(struct mem_chunk **mcp);
 
+/**
+ * mc_free_batch() - Free multiple memory chunks of the same mpset.
+ *
+ * Each backing pool is locked only once for the whole batch. NULL entries are skipped, a chunk
+ * must not appear more than once.
+ *
+ * @mcs: Array of memory chunks to be freed(entries are set to NULL)
+ * @count: Number of chunks
+ */
+void mc_free_batch(struct mem_chunk **mcs, u32 count);
+
+// mmap() offsets of host memory chunks start here, see mc_get_mmap_offset().
+#define MC_MMAP_START_OFFSET (1ULL << 56)
+// Number of bits of the key encoded in an mmap() offset.
+#define MC_MMAP_KEY_BITS 44
+
+struct vm_area_struct;
+
+/**
+ * mc_get_mmap_offset() - Get the mmap() offset of a host memory chunk.
+ *
+ * The offset encodes the key its owner finds the chunk by, not the chunk's address, so only
+ * chunks the caller of mmap() can look up are ever mapped.
+ *
+ * @mc: Memory chunk
+ * @key: key of the chunk, passed back to the lookup function of mpset_mmap()
+ * @offset: Offset is returned here
+ *
+ * Return: 0 on success, -EINVAL if the chunk can not be mapped to user space or the key does not
+ * fit in MC_MMAP_KEY_BITS.
+ */
+int mc_get_mmap_offset(struct mem_chunk *mc, u64 key, u64 *offset);
+
+/**
+ * Returns the host chunk of a key given to mc_get_mmap_offset() or NULL, used by mpset_mmap().
+ * Called with mpset->host_lock held, which keeps a returned host chunk from being freed.
+ */
+typedef struct mem_chunk *(*mc_lookup_fn_t)(void *data, u64 key);
+
+/**
+ * mpset_mmap() - Map the host memory chunk at given mmap() offset.
+ *
+ * The chunk's memory is kept alive until it is both freed and unmapped.
+ *
+ * @mpset: mpset which owns the chunk
+ * @offset: mmap() offset returned by mc_get_mmap_offset()
+ * @lookup: function which finds the chunk of the key in the offset
+ * @data: passed to lookup
+ * @vma: user vma to map into
+ *
+ * Return: 0 on success, a negative error code otherwise.
+ */
+int mpset_mmap(struct mempool_set *mpset, u64 offset, mc_lookup_fn_t lookup, void *data,
+	       struct vm_area_struct *vma);
+
+/**
+ * Copies size bytes of device memory of the chunk from src to dst, used by mpset_compact().
+ * The ranges do not overlap.
+ */
+typedef int (*mc_copy_fn_t)(void *data, struct mem_chunk *mc, u64 src, u64 dst, u32 size);
+
+/**
+ * mpset_compact() - Compact a device memory pool by moving MC_ALLOC_RELOCATABLE chunks.
+ *
+ * Relocatable chunks are visited from the highest address down and each is moved to the lowest
+ * free range which fits it, if that is below its current address; this coalesces free memory at
+ * the end of the pool. mc->pa of a moved chunk changes and mpset->device_generation is
+ * incremented, so owners which observe a new generation must re-read the pa of their
+ * relocatable chunks. The owner must not use the chunks while compaction is running.
+ *
+ * Chunks are copied in batches of MC_COMPACT_BATCH without the pool lock, so the pool can be used
+ * for other allocations meanwhile. Freeing a picked chunk waits until it is moved. The new pa of
+ * a batch is published with mpset->relocate_lock held for write, see mpset_relocate_lock().
+ *
+ * @mpset: mpset which owns the pool
+ * @channel: DRAM channel of the pool
+ * @region: DRAM region of the pool
+ * @copy: function which copies the chunk contents to the new location
+ * @data: passed to copy
+ * @moved_count: number of moved chunks is returned here
+ * @moved_size: total size of moved chunks is returned here
+ *
+ * Return: 0 on success, a negative error code otherwise. Chunks moved before an error stay moved.
+ */
+int mpset_compact(struct mempool_set *mpset, u32 channel, u32 region, mc_copy_fn_t copy,
+		  void *data, u32 *moved_count, u64 *moved_size);
+
+/**
+ * mpset_relocate_lock() - Keep mpset_compact() from moving device chunks.
+ *
+ * Must be held from reading the pa of a device chunk until the device is done using it, so a
+ * chunk's old memory is not written after it was moved and freed.
+ */
+void mpset_relocate_lock(struct mempool_set *mpset);
+
+void mpset_relocate_unlock(struct mempool_set *mpset);
+
 #endif
@@ -6,8 +6,11 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/debugfs.h>
 #include <linux/fault-inject.h>
 
+#include "neuron_debugfs.h"
+
 /* Only this file should create trace points, anywhere else just include neuron_trace.h*/
 #define CREATE_TRACE_POINTS
 #include "neuron_trace.h"
@@ -31,26 +34,26 @@ extern struct fault_attr neuron_fail_dma_wait;
 extern struct fault_attr neuron_fail_mc_alloc;
 extern struct fault_attr neuron_fail_fwio_read;
 extern struct fault_attr neuron_fail_fwio_post_metric;
-
-static struct dentry *dbgfs_root;
+#endif
 
 static void neuron_module_init_debugfs(void)
 {
-	dbgfs_root = debugfs_create_dir("neuron", NULL);
-	fault_create_debugfs_attr("fail_nc_mmap", dbgfs_root, &neuron_fail_nc_mmap);
-	fault_create_debugfs_attr("fail_dma_wait", dbgfs_root, &neuron_fail_dma_wait);
-	fault_create_debugfs_attr("fail_mc_alloc", dbgfs_root, &neuron_fail_mc_alloc);
-	fault_create_debugfs_attr("fail_fwio_read", dbgfs_root, &neuron_fail_fwio_read);
-	fault_create_debugfs_attr("fail_fwio_post_metric", dbgfs_root,
+	neuron_dbgfs_root = debugfs_create_dir("neuron", NULL);
+#ifdef CONFIG_FAULT_INJECTION
+	fault_create_debugfs_attr("fail_nc_mmap", neuron_dbgfs_root, &neuron_fail_nc_mmap);
+	fault_create_debugfs_attr("fail_dma_wait", neuron_dbgfs_root, &neuron_fail_dma_wait);
+	fault_create_debugfs_attr("fail_mc_alloc", neuron_dbgfs_root, &neuron_fail_mc_alloc);
+	fault_create_debugfs_attr("fail_fwio_read", neuron_dbgfs_root, &neuron_fail_fwio_read);
+	fault_create_debugfs_attr("fail_fwio_post_metric", neuron_dbgfs_root,
 				  &neuron_fail_fwio_post_metric);
+#endif
 }
 
 static void neuron_module_free_debugfs(void)
 {
-	debugfs_remove_recursive(dbgfs_root);
-	dbgfs_root = NULL;
+	debugfs_remove_recursive(neuron_dbgfs_root);
+	neuron_dbgfs_root = NULL;
 }
-#endif
 
 static int __init neuron_module_init(void)
 {
@@ -58,28 +61,38 @@ static int __init neuron_module_init(void)
 
 	printk(KERN_INFO "Neuron Driver Started with Version:%s", driver_version);
 
-#ifdef CONFIG_FAULT_INJECTION
 	neuron_module_init_debugfs();
-#endif
+
+	ret = mempool_module_init();
+	if (ret)
+		goto fail_mempool;
 
 	ret = ncdev_module_init();
 	if (ret)
-		return ret;
+		goto fail_ncdev;
 
 	ret = neuron_pci_module_init();
 	if (ret)
-		return ret;
+		goto fail_pci;
 
 	return 0;
+
+fail_pci:
+	ncdev_module_exit();
+fail_ncdev:
+	mempool_module_exit();
+fail_mempool:
+	neuron_module_free_debugfs();
+	return ret;
 }
 
 static void __exit neuron_module_exit(void)
 {
-#ifdef CONFIG_FAULT_INJECTION
-	neuron_module_free_debugfs();
-#endif
 	neuron_pci_module_exit();
 	ncdev_module_exit();
+	mempool_module_exit();
+	// device directories are removed by neuron_pci_module_exit()
+	neuron_module_free_debugfs();
 }
 
 module_init(neuron_module_init);
@@ -10,13 +10,16 @@
 #include <linux/module.h>
 #include <linux/pci.h>
 #include <linux/atomic.h>
+#include <linux/dma-mapping.h>
 #include <linux/version.h>
 
 #include "neuron_device.h"
 #include "v1/fw_io.h"
 #include "v1/address_map.h"
 
+#include "neuron_debugfs.h"
 #include "neuron_dma.h"
+#include "neuron_sysfs.h"
 
 /* Vendor / Device ID for all devices supported by the driver */
 #define INF_VENDOR_ID 0x1D0F
@@ -24,6 +27,10 @@
 #define INF_DEVICE_ID1 0x7065
 #define INF_DEVICE_ID2 0x7066
 #define INF_DEVICE_ID3 0x7067
+// The device reaches host memory at PCIEX8_0_BASE + host address, so streaming DMA addresses must
+// be below that bit. Coherent allocations keep the default 32 bit mask.
+#define NEURON_DMA_ADDR_BITS 46
+
 static struct pci_device_id neuron_pci_dev_ids[] = {
 	{ PCI_DEVICE(INF_VENDOR_ID, INF_DEVICE_ID0) },
 	{ PCI_DEVICE(INF_VENDOR_ID, INF_DEVICE_ID1) },
@@ -46,6 +53,27 @@ static struct pci_device_id neuron_pci_dev_ids[] = {
 // number of devices managed
 static atomic_t device_count = ATOMIC_INIT(0);
 
+int neuron_numa_node = -1;
+
+module_param(neuron_numa_node, int, S_IRUSR | S_IRGRP);
+MODULE_PARM_DESC(neuron_numa_node,
+		 "NUMA node for host memory of the devices: -1 - device's node, -2 - no affinity, >=0 - given node");
+
+/**
+ * neuron_pci_numa_node() - Returns the NUMA node host memory of the device should be allocated from.
+ */
+static int neuron_pci_numa_node(struct pci_dev *pdev)
+{
+	if (neuron_numa_node == -2)
+		return NUMA_NO_NODE;
+	if (neuron_numa_node >= 0) {
+		if (neuron_numa_node < nr_node_ids && node_online(neuron_numa_node))
+			return neuron_numa_node;
+		pci_info(pdev, "NUMA node %d is not online, using device's node\n", neuron_numa_node);
+	}
+	return dev_to_node(&pdev->dev);
+}
+
 extern int ncdev_create_device_node(struct neuron_device *ndev);
 extern int ncdev_delete_device_node(struct neuron_device *ndev);
 extern void ndmar_preinit(struct neuron_device *nd);
@@ -53,12 +81,14 @@ extern void ndmar_preinit(struct neuron_device *nd);
 static int neuron_pci_device_init(struct neuron_device *nd)
 {
 	int ret;
+	int numa_node;
 
 	if (nd == NULL)
 		return -1;
 
+	numa_node = neuron_pci_numa_node(nd->pdev);
 	nd->fw_io_ctx = fw_io_setup(nd->device_index, nd->npdev.bar0, nd->npdev.bar0_size,
-				    nd->npdev.bar2, nd->npdev.bar2_size);
+				    nd->npdev.bar2, nd->npdev.bar2_size, numa_node);
 	if (nd->fw_io_ctx == NULL)
 		return -1;
 
@@ -68,12 +98,12 @@ static int neuron_pci_device_init(struct neuron_device *nd)
 	memset(&nd->mpset, 0, sizeof(struct mempool_set));
 
 	// Initialize the host portion in mpset
+	nd->mpset.pdev = &(nd->pdev->dev);
+	nd->mpset.numa_node = numa_node;
 	ret = mpset_host_init(&nd->mpset);
 	if (ret)
 		goto fail_mpset;
 
-	nd->mpset.pdev = &(nd->pdev->dev);
-
 	pci_read_config_byte(nd->pdev, PCI_REVISION_ID, &nd->revision);
 	// Initialize the arch type to Inferentia
 	nd->architecture = NEURON_ARCH_INFERENTIA;
@@ -82,8 +112,16 @@ static int neuron_pci_device_init(struct neuron_device *nd)
 		pci_info(nd->pdev, "create device node failed\n");
 		goto fail_chardev;
 	}
+	ret = neuron_sysfs_init(nd);
+	if (ret) {
+		pci_info(nd->pdev, "create sysfs attributes failed\n");
+		goto fail_sysfs;
+	}
+	neuron_debugfs_init(nd);
 	return 0;
 
+fail_sysfs:
+	ncdev_delete_device_node(nd);
 fail_chardev:
 	mpset_destroy(&nd->mpset);
 fail_mpset:
@@ -96,6 +134,8 @@ int neuron_pci_device_close(struct neuron_device *nd)
 {
 	int ret;
 
+	neuron_debugfs_destroy(nd);
+	neuron_sysfs_destroy(nd);
 	ret = ncdev_delete_device_node(nd);
 	if (ret) {
 		pci_info(nd->pdev, "delete device node failed\n");
@@ -120,7 +160,7 @@ static int neuron_pci_probe(struct pci_dev *dev, const struct pci_device_id *id)
 	int ret = 0;
 	struct neuron_device *nd;
 
-	nd = kzalloc(sizeof(struct neuron_device), GFP_KERNEL);
+	nd = kzalloc_node(sizeof(struct neuron_device), GFP_KERNEL, dev_to_node(&dev->dev));
 	if (nd == NULL) {
 		pci_info(dev, "Can't allocate memory\n");
 		goto fail_alloc_mem;
@@ -135,6 +175,16 @@ static int neuron_pci_probe(struct pci_dev *dev, const struct pci_device_id *id)
 		goto fail_enable;
 	}
 
+	ret = dma_set_mask(&dev->dev, DMA_BIT_MASK(NEURON_DMA_ADDR_BITS));
+	if (ret) {
+		pci_info(dev, "Can't use %d bit DMA addresses, using 32 bit\n", NEURON_DMA_ADDR_BITS);
+		ret = dma_set_mask(&dev->dev, DMA_BIT_MASK(32));
+		if (ret) {
+			pci_info(dev, "Can't set DMA mask\n");
+			goto fail_bar0_map;
+		}
+	}
+
 	ret = pci_request_region(dev, INF_APB_BAR, "APB");
 	if (ret) {
 		pci_info(dev, "Can't map BAR0\n");
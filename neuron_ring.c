@@ -5,6 +5,7 @@
 
 #define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
 
+#include <linux/module.h>
 #include <linux/string.h>
 #include <linux/types.h>
 
@@ -16,6 +17,11 @@
 #include "neuron_dma.h"
 #include "neuron_mempool.h"
 
+int ndma_staging_buffers = 8;
+module_param(ndma_staging_buffers, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(ndma_staging_buffers,
+		 "Host staging buffers preallocated per device at device init, each 256KiB");
+
 static struct ndma_eng *ndmar_acquire_engine(struct neuron_device *nd, u32 eng_id)
 {
 	if (eng_id >= NUM_DMA_ENG_PER_DEVICE)
@@ -206,7 +212,7 @@ int ndmar_h2t_ring_alloc(struct neuron_device *nd, int nc_id)
 	int ndesc = DMA_H2T_DESC_COUNT;
 	u32 ring_size = ndmar_ring_get_desc_count(ndesc) * sizeof(union udma_desc);
 	int qid = MAX_DMA_RINGS - 1;
-	struct mem_chunk *rx_mc = NULL, *tx_mc = NULL;
+	struct mem_chunk *rx_mc = NULL, *tx_mc = NULL, *completion_mc = NULL;
 
 	eng = ndmar_acquire_engine(nd, eng_id);
 	if (eng == NULL)
@@ -221,20 +227,28 @@ int ndmar_h2t_ring_alloc(struct neuron_device *nd, int nc_id)
 	ring->size = ring_size;
 	ring->has_compl = false;
 
-	ret = mc_alloc(&nd->mpset, &rx_mc, ring_size, MEM_LOC_HOST, 0, 0, nc_id);
+	ret = mc_alloc(&nd->mpset, &rx_mc, ring_size, MEM_LOC_HOST, 0, 0, nc_id, MC_ALLOC_INTERNAL);
 	if (ret) {
 		pr_err("can't allocate rx queue for H2T - size %d\n", ring_size);
 		goto error;
 	}
 
-	ret = mc_alloc(&nd->mpset, &tx_mc, ring_size, MEM_LOC_HOST, 0, 0, nc_id);
+	ret = mc_alloc(&nd->mpset, &tx_mc, ring_size, MEM_LOC_HOST, 0, 0, nc_id, MC_ALLOC_INTERNAL);
 	if (ret) {
 		pr_err("can't allocate tx queue for H2T - size %d\n", ring_size);
 		goto error;
 	}
 
+	ret = mc_alloc(&nd->mpset, &completion_mc, DMA_H2T_COMPLETION_SIZE, MEM_LOC_HOST, 0, 0,
+		       nc_id, MC_ALLOC_INTERNAL);
+	if (ret) {
+		pr_err("can't allocate completion buffer for H2T\n");
+		goto error;
+	}
+
 	ndmar_ring_set_mem_chunk(eng, qid, tx_mc, 0, NEURON_DMA_QUEUE_TYPE_TX);
 	ndmar_ring_set_mem_chunk(eng, qid, rx_mc, 0, NEURON_DMA_QUEUE_TYPE_RX);
+	eng->h2t_completion_mc = completion_mc;
 
 	mutex_init(&eng->h2t_ring_lock);
 
@@ -249,6 +263,8 @@ error:
 		mc_free(&rx_mc);
 	if (tx_mc)
 		mc_free(&tx_mc);
+	if (completion_mc)
+		mc_free(&completion_mc);
 
 	return ret;
 }
@@ -389,6 +405,117 @@ void ndmar_preinit(struct neuron_device *nd)
 		eng->eng_id = i;
 		mutex_init(&eng->lock);
 	}
+	spin_lock_init(&nd->staging.lock);
+	INIT_LIST_HEAD(&nd->staging.free);
+}
+
+/**
+ * ndmar_staging_init() - Preallocate the staging pool of the device.
+ *
+ * A pool smaller than requested, or none, is not an error, ndmar_staging_get() then allocates.
+ */
+static void ndmar_staging_init(struct neuron_device *nd)
+{
+	struct ndma_staging_pool *pool = &nd->staging;
+	u32 count = clamp(READ_ONCE(ndma_staging_buffers), 0, 1024);
+	u32 i;
+
+	if (count == 0)
+		return;
+	pool->bufs = kcalloc(count, sizeof(*pool->bufs), GFP_KERNEL);
+	if (pool->bufs == NULL)
+		return;
+	// the pool serves all NCs, it is not charged to any of them
+	if (mc_alloc(&nd->mpset, &pool->markers_mc, count * sizeof(u32), MEM_LOC_HOST, 0, 0, 0,
+		     MC_ALLOC_INTERNAL | MC_ALLOC_NO_CHARGE))
+		goto fail;
+	for (i = 0; i < count; i++) {
+		struct ndma_staging_buf *buf = &pool->bufs[i];
+
+		if (mc_alloc(&nd->mpset, &buf->mc, NDMA_STAGING_BUF_SIZE, MEM_LOC_HOST, 0, 0, 0,
+			     MC_ALLOC_NO_ZERO | MC_ALLOC_INTERNAL | MC_ALLOC_NO_CHARGE))
+			break;
+		buf->marker = (u32 *)pool->markers_mc->va + i;
+		buf->marker_addr = (pool->markers_mc->pa | PCIEX8_0_BASE) + i * sizeof(u32);
+		buf->pooled = true;
+		list_add_tail(&buf->node, &pool->free);
+	}
+	pool->count = i;
+	if (i < count)
+		pr_info("staging pool has %u of %u buffers\n", i, count);
+	if (i)
+		return;
+	mc_free(&pool->markers_mc);
+fail:
+	kfree(pool->bufs);
+	pool->bufs = NULL;
+}
+
+static void ndmar_staging_free(struct neuron_device *nd)
+{
+	struct ndma_staging_pool *pool = &nd->staging;
+	u32 i;
+
+	if (pool->bufs == NULL)
+		return;
+	for (i = 0; i < pool->count; i++)
+		mc_free(&pool->bufs[i].mc);
+	mc_free(&pool->markers_mc);
+	kfree(pool->bufs);
+	pool->bufs = NULL;
+	pool->count = 0;
+	INIT_LIST_HEAD(&pool->free);
+}
+
+int ndmar_staging_get(struct neuron_device *nd, u32 size, u32 nc_id,
+		      struct ndma_staging_buf **result)
+{
+	struct ndma_staging_pool *pool = &nd->staging;
+	struct ndma_staging_buf *buf = NULL;
+	u32 alloc_size;
+	int ret;
+
+	if (size <= NDMA_STAGING_BUF_SIZE) {
+		spin_lock(&pool->lock);
+		buf = list_first_entry_or_null(&pool->free, struct ndma_staging_buf, node);
+		if (buf)
+			list_del(&buf->node);
+		spin_unlock(&pool->lock);
+		if (buf) {
+			*result = buf;
+			return 0;
+		}
+	}
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (buf == NULL)
+		return -ENOMEM;
+	// the completion marker goes right after the data
+	alloc_size = ALIGN(size, sizeof(u32));
+	ret = mc_alloc(&nd->mpset, &buf->mc, alloc_size + sizeof(u32), MEM_LOC_HOST, 0, 0, nc_id,
+		       MC_ALLOC_NO_ZERO | MC_ALLOC_INTERNAL);
+	if (ret) {
+		kfree(buf);
+		return ret;
+	}
+	buf->marker = buf->mc->va + alloc_size;
+	buf->marker_addr = (buf->mc->pa | PCIEX8_0_BASE) + alloc_size;
+	*result = buf;
+	return 0;
+}
+
+void ndmar_staging_put(struct neuron_device *nd, struct ndma_staging_buf *buf)
+{
+	struct ndma_staging_pool *pool = &nd->staging;
+
+	if (!buf->pooled) {
+		mc_free(&buf->mc);
+		kfree(buf);
+		return;
+	}
+	spin_lock(&pool->lock);
+	list_add(&buf->node, &pool->free);
+	spin_unlock(&pool->lock);
 }
 
 int ndmar_init(struct neuron_device *nd)
@@ -422,6 +549,7 @@ int ndmar_init(struct neuron_device *nd)
 			return ret;
 		}
 	}
+	ndmar_staging_init(nd);
 
 	return ret;
 }
@@ -447,6 +575,9 @@ static void ndmar_h2t_ring_free(struct neuron_device *nd, int eng_id)
 	if (ring->rxc_mc)
 		mc_free(&ring->rxc_mc);
 
+	if (eng->h2t_completion_mc)
+		mc_free(&eng->h2t_completion_mc);
+
 	ndmar_release_engine(eng);
 }
 
@@ -456,5 +587,6 @@ void ndmar_close(struct neuron_device *nd)
 	for (nc_id = 0; nc_id < V1_NC_PER_DEVICE; nc_id++) {
 		ndmar_h2t_ring_free(nd, DMA_ENG_IDX_H2T + (nc_id * V1_DMA_ENG_PER_NC));
 	}
+	ndmar_staging_free(nd);
 	return;
 }
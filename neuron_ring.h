@@ -6,12 +6,17 @@
 #ifndef NEURON_RING_H
 #define NEURON_RING_H
 
+#include <linux/list.h>
+#include <linux/spinlock.h>
+
 #include "udma/udma.h"
 #include "v1/tdma.h"
 #include "v1/address_map.h"
 
 #define DMA_ENG_IDX_H2T 2
 #define DMA_H2T_DESC_COUNT 4096
+// size of the host buffer holding the source and destination markers of a H2T completion copy
+#define DMA_H2T_COMPLETION_SIZE (2 * sizeof(u32))
 #define MAX_DMA_RINGS 16
 
 #define NUM_DMA_ENG_PER_DEVICE (V1_NC_PER_DEVICE * V1_DMA_ENG_PER_NC)
@@ -40,6 +45,30 @@ struct ndma_queue {
 	bool in_use;
 };
 
+// size of each buffer of the per device staging pool
+#define NDMA_STAGING_BUF_SIZE (256 * 1024)
+
+/* Host buffer an ioctl bounces user data through, see ndmar_staging_get(). */
+struct ndma_staging_buf {
+	struct list_head node; // entry in the pool's free list
+	struct mem_chunk *mc; // host memory of the buffer
+	volatile u32 *marker; // completion marker of a DMA to or from the buffer
+	dma_addr_t marker_addr; // device address of marker
+	bool pooled; // false if allocated because the pool had no free buffer large enough
+};
+
+/* Preallocated staging buffers of a device, borrowed and returned without touching the mpset.
+ *
+ * Created by ndmar_init() and freed by ndmar_close(), so only a device owner uses it.
+ */
+struct ndma_staging_pool {
+	spinlock_t lock; // protects free
+	struct list_head free; // buffers not borrowed
+	struct ndma_staging_buf *bufs; // all the buffers of the pool
+	u32 count; // number of entries in bufs
+	struct mem_chunk *markers_mc; // completion markers of the buffers, one u32 each
+};
+
 struct ndma_eng {
 	struct mutex lock;
 	struct neuron_device *nd;
@@ -48,6 +77,7 @@ struct ndma_eng {
 	struct udma udma;
 	bool used_for_h2t;
 	struct mutex h2t_ring_lock;
+	struct mem_chunk *h2t_completion_mc; // completion markers polled by H2T copies, h2t_ring_lock
 };
 
 /**
@@ -68,6 +98,32 @@ int ndmar_init(struct neuron_device *nd);
  */
 void ndmar_close(struct neuron_device *nd);
 
+/**
+ * ndmar_staging_get() - Borrow a host staging buffer.
+ *
+ * The buffer comes from the device's staging pool if one is free and large enough, it is
+ * allocated from the mpset otherwise.
+ *
+ * @nd: Neuron device
+ * @size: minimum buffer size
+ * @nc_id: neuron core an allocated buffer is charged to
+ * @result: Buffer to store the staging buffer pointer
+ *
+ * Return: 0 on success, a negative error code otherwise.
+ */
+int ndmar_staging_get(struct neuron_device *nd, u32 size, u32 nc_id,
+		      struct ndma_staging_buf **result);
+
+/**
+ * ndmar_staging_put() - Return a buffer borrowed with ndmar_staging_get().
+ *
+ * The device must not be accessing the buffer anymore.
+ *
+ * @nd: Neuron device
+ * @buf: staging buffer
+ */
+void ndmar_staging_put(struct neuron_device *nd, struct ndma_staging_buf *buf);
+
 /**
  * ndmar_eng_init() - Initialize a DMA engine
  *
@@ -0,0 +1,242 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright 2020, Amazon.com, Inc. or its affiliates. All Rights Reserved
+ */
+
+/* Exposes per device statistics through sysfs. */
+
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/nodemask.h>
+#include <linux/pci.h>
+#include <linux/sysfs.h>
+
+#include "neuron_device.h"
+#include "neuron_sysfs.h"
+
+static struct mempool_set *dev_to_mpset(struct device *dev)
+{
+	struct neuron_device *nd = pci_get_drvdata(to_pci_dev(dev));
+
+	return &nd->mpset;
+}
+
+// Defines a read only attribute which shows given u64 expression of the device's mpset.
+#define MPSET_ATTR_RO(_name, _expr)                                                                \
+	static ssize_t _name##_show(struct device *dev, struct device_attribute *attr, char *buf) \
+	{                                                                                          \
+		struct mempool_set *mpset = dev_to_mpset(dev);                                     \
+		return scnprintf(buf, PAGE_SIZE, "%llu\n", (u64)(_expr));                          \
+	}                                                                                          \
+	static DEVICE_ATTR_RO(_name)
+
+MPSET_ATTR_RO(host_mem_size, atomic64_read(&mpset->host_mem_size));
+MPSET_ATTR_RO(device_mem_size, atomic64_read(&mpset->device_mem_size));
+MPSET_ATTR_RO(device_generation, atomic64_read(&mpset->device_generation));
+MPSET_ATTR_RO(host_remote_allocs, atomic64_read(&mpset->host_remote_allocs));
+MPSET_ATTR_RO(host_freelist_hits, READ_ONCE(mpset->host_freelist_hits));
+MPSET_ATTR_RO(host_freelist_misses, READ_ONCE(mpset->host_freelist_misses));
+MPSET_ATTR_RO(host_zeroed_hits, READ_ONCE(mpset->host_zeroed_hits));
+MPSET_ATTR_RO(coherent_cache_hits, READ_ONCE(mpset->coherent_cache_hits));
+MPSET_ATTR_RO(coherent_cache_misses, READ_ONCE(mpset->coherent_cache_misses));
+MPSET_ATTR_RO(coherent_cache_size, READ_ONCE(mpset->coherent_cache_size));
+MPSET_ATTR_RO(host_reserved_size,
+	      mpset->host_reserved_va ? mpset->host_reserved.region_size : 0);
+MPSET_ATTR_RO(host_reserved_allocated,
+	      mpset->host_reserved_va ? READ_ONCE(mpset->host_reserved.allocated_size) : 0);
+
+// one line per online NUMA node, host memory used on the node
+static ssize_t host_node_mem_size_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct mempool_set *mpset = dev_to_mpset(dev);
+	ssize_t len = 0;
+	int node;
+
+	for_each_online_node (node) {
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%d %lld\n", node,
+				 atomic64_read(&mpset->host_node_size[node]));
+	}
+	return len;
+}
+static DEVICE_ATTR_RO(host_node_mem_size);
+
+// one line per NeuronCore, memory used by the NC and its limits(0 for no limit)
+static ssize_t nc_mem_usage_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct mempool_set *mpset = dev_to_mpset(dev);
+	ssize_t len = 0;
+	int nc_id;
+
+	len += scnprintf(buf + len, PAGE_SIZE - len,
+			 "nc host_mem_size device_mem_size host_mem_limit device_mem_limit\n");
+	for (nc_id = 0; nc_id < V1_NC_PER_DEVICE; nc_id++) {
+		struct mpset_nc_usage *usage = &mpset->nc_usage[nc_id];
+
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%d %lld %lld %llu %llu\n", nc_id,
+				 percpu_counter_sum_positive(&usage->host_mem_size),
+				 percpu_counter_sum_positive(&usage->device_mem_size),
+				 READ_ONCE(usage->host_mem_limit),
+				 READ_ONCE(usage->device_mem_limit));
+	}
+	return len;
+}
+static DEVICE_ATTR_RO(nc_mem_usage);
+
+/**
+ * nc_mem_limit_store() - Parse "<nc_id> <bytes>" and set the limit of the NC.
+ *
+ * A limit below current usage only affects later allocations.
+ */
+static ssize_t nc_mem_limit_store(struct device *dev, const char *buf, size_t count, bool host)
+{
+	struct mempool_set *mpset = dev_to_mpset(dev);
+	u32 nc_id;
+	u64 limit;
+
+	if (sscanf(buf, "%u %llu", &nc_id, &limit) != 2 || nc_id >= V1_NC_PER_DEVICE)
+		return -EINVAL;
+	if (host)
+		WRITE_ONCE(mpset->nc_usage[nc_id].host_mem_limit, limit);
+	else
+		WRITE_ONCE(mpset->nc_usage[nc_id].device_mem_limit, limit);
+	return count;
+}
+
+// one "<nc_id> <bytes>" line per NC, the format nc_mem_limit_store() parses
+static ssize_t nc_mem_limit_show(struct device *dev, char *buf, bool host)
+{
+	struct mempool_set *mpset = dev_to_mpset(dev);
+	ssize_t len = 0;
+	int nc_id;
+
+	for (nc_id = 0; nc_id < V1_NC_PER_DEVICE; nc_id++) {
+		struct mpset_nc_usage *usage = &mpset->nc_usage[nc_id];
+
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%d %llu\n", nc_id,
+				 host ? READ_ONCE(usage->host_mem_limit) :
+					READ_ONCE(usage->device_mem_limit));
+	}
+	return len;
+}
+
+static ssize_t nc_host_mem_limit_show(struct device *dev, struct device_attribute *attr,
+				      char *buf)
+{
+	return nc_mem_limit_show(dev, buf, true);
+}
+
+static ssize_t nc_host_mem_limit_store(struct device *dev, struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	return nc_mem_limit_store(dev, buf, count, true);
+}
+static DEVICE_ATTR_RW(nc_host_mem_limit);
+
+static ssize_t nc_device_mem_limit_show(struct device *dev, struct device_attribute *attr,
+					char *buf)
+{
+	return nc_mem_limit_show(dev, buf, false);
+}
+
+static ssize_t nc_device_mem_limit_store(struct device *dev, struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	return nc_mem_limit_store(dev, buf, count, false);
+}
+static DEVICE_ATTR_RW(nc_device_mem_limit);
+
+static ssize_t device_pools_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct mempool_set *mpset = dev_to_mpset(dev);
+	ssize_t len = 0;
+	u32 channel, region;
+
+	len += scnprintf(buf + len, PAGE_SIZE - len,
+			 "channel region allocator size allocated free largest_free free_extents "
+			 "dma_bytes\n");
+	mutex_lock(&mpset->device_pools_lock);
+	for (channel = 0; channel < V1_MAX_DRAM_CHANNELS; channel++) {
+		for (region = 0; region < MAX_DDR_REGIONS; region++) {
+			struct mempool *mp = &mpset->mp_device[channel][region];
+			struct mempool_frag_stats stats;
+
+			if (!mp->initialized)
+				continue;
+			mp_get_frag_stats(mp, &stats);
+			len += scnprintf(buf + len, PAGE_SIZE - len,
+					 "%u %u %s %zu %zu %llu %llu %llu %lld\n", channel, region,
+					 mp->ops->name, mp->region_size, mp->allocated_size,
+					 stats.free_size, stats.largest_free, stats.free_extents,
+					 atomic64_read(&mp->dma_bytes));
+		}
+	}
+	mutex_unlock(&mpset->device_pools_lock);
+	return len;
+}
+static DEVICE_ATTR_RO(device_pools);
+
+// one line per pool, free extent count of each power of 2 size starting at min alloc size
+static ssize_t device_pools_free_hist_show(struct device *dev, struct device_attribute *attr,
+					   char *buf)
+{
+	struct mempool_set *mpset = dev_to_mpset(dev);
+	ssize_t len = 0;
+	u32 channel, region;
+	int i;
+
+	mutex_lock(&mpset->device_pools_lock);
+	for (channel = 0; channel < V1_MAX_DRAM_CHANNELS; channel++) {
+		for (region = 0; region < MAX_DDR_REGIONS; region++) {
+			struct mempool *mp = &mpset->mp_device[channel][region];
+			struct mempool_frag_stats stats;
+
+			if (!mp->initialized)
+				continue;
+			mp_get_frag_stats(mp, &stats);
+			len += scnprintf(buf + len, PAGE_SIZE - len, "%u %u", channel, region);
+			for (i = 0; i < MEMPOOL_FRAG_HIST_BUCKETS; i++)
+				len += scnprintf(buf + len, PAGE_SIZE - len, " %u", stats.hist[i]);
+			len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+		}
+	}
+	mutex_unlock(&mpset->device_pools_lock);
+	return len;
+}
+static DEVICE_ATTR_RO(device_pools_free_hist);
+
+static struct attribute *neuron_mempool_attrs[] = {
+	&dev_attr_host_mem_size.attr,
+	&dev_attr_device_mem_size.attr,
+	&dev_attr_device_generation.attr,
+	&dev_attr_host_node_mem_size.attr,
+	&dev_attr_host_remote_allocs.attr,
+	&dev_attr_nc_mem_usage.attr,
+	&dev_attr_nc_host_mem_limit.attr,
+	&dev_attr_nc_device_mem_limit.attr,
+	&dev_attr_host_freelist_hits.attr,
+	&dev_attr_host_freelist_misses.attr,
+	&dev_attr_host_zeroed_hits.attr,
+	&dev_attr_coherent_cache_hits.attr,
+	&dev_attr_coherent_cache_misses.attr,
+	&dev_attr_coherent_cache_size.attr,
+	&dev_attr_host_reserved_size.attr,
+	&dev_attr_host_reserved_allocated.attr,
+	&dev_attr_device_pools.attr,
+	&dev_attr_device_pools_free_hist.attr,
+	NULL,
+};
+
+static const struct attribute_group neuron_mempool_group = {
+	.name = "mempool",
+	.attrs = neuron_mempool_attrs,
+};
+
+int neuron_sysfs_init(struct neuron_device *nd)
+{
+	return sysfs_create_group(&nd->pdev->dev.kobj, &neuron_mempool_group);
+}
+
+void neuron_sysfs_destroy(struct neuron_device *nd)
+{
+	sysfs_remove_group(&nd->pdev->dev.kobj, &neuron_mempool_group);
+}
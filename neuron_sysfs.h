@@ -0,0 +1,29 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright 2020, Amazon.com, Inc. or its affiliates. All Rights Reserved
+ */
+
+#ifndef NEURON_SYSFS_H
+#define NEURON_SYSFS_H
+
+struct neuron_device;
+
+/**
+ * neuron_sysfs_init() - Create the sysfs attributes of a neuron device.
+ *
+ * The attributes are created under the PCI device's directory.
+ *
+ * @nd: neuron device
+ *
+ * Return: 0 on success, a negative error code otherwise.
+ */
+int neuron_sysfs_init(struct neuron_device *nd);
+
+/**
+ * neuron_sysfs_destroy() - Remove the sysfs attributes created by neuron_sysfs_init().
+ *
+ * @nd: neuron device
+ */
+void neuron_sysfs_destroy(struct neuron_device *nd);
+
+#endif
@@ -454,9 +454,10 @@ int fw_io_read_counters(struct fw_io_ctx *ctx, uint64_t addr_in[], uint32_t val_
 #define FW_IO_MAX_SIZE 0xffff
 
 struct fw_io_ctx *fw_io_setup(int device_index, void __iomem *bar0, u64 bar0_size,
-			      void __iomem *bar2, u64 bar2_size)
+			      void __iomem *bar2, u64 bar2_size, int numa_node)
 {
-	struct fw_io_ctx *ctx = (struct fw_io_ctx *)kzalloc(sizeof(struct fw_io_ctx), GFP_KERNEL);
+	struct fw_io_ctx *ctx =
+		(struct fw_io_ctx *)kzalloc_node(sizeof(struct fw_io_ctx), GFP_KERNEL, numa_node);
 	if (ctx == NULL) {
 		pr_err("memory allocation failed\n");
 		return NULL;
@@ -465,7 +466,7 @@ struct fw_io_ctx *fw_io_setup(int device_index, void __iomem *bar0, u64 bar0_siz
 	ctx->next_seq_num = 1;
 	mutex_init(&ctx->lock);
 
-	ctx->request = kmalloc(FW_IO_MAX_SIZE, GFP_ATOMIC);
+	ctx->request = kmalloc_node(FW_IO_MAX_SIZE, GFP_ATOMIC, numa_node);
 	if (ctx->request == NULL) {
 		pr_err("memory allocation failed\n");
 		goto error;
@@ -474,7 +475,7 @@ struct fw_io_ctx *fw_io_setup(int device_index, void __iomem *bar0, u64 bar0_siz
 	ctx->request_addr = virt_to_phys(ctx->request);
 	ctx->request_addr |= PCIEX8_0_BASE;
 
-	ctx->response = kmalloc(FW_IO_MAX_SIZE, GFP_ATOMIC);
+	ctx->response = kmalloc_node(FW_IO_MAX_SIZE, GFP_ATOMIC, numa_node);
 	if (ctx->response == NULL) {
 		pr_err("memory allocation failed\n");
 		goto error;
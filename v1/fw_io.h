@@ -17,11 +17,12 @@
  * @bar0_size: Size of BAR0
  * @bar2: BAR2 virtual address
  * @bar2_size: Size of BAR2
+ * @numa_node: NUMA node on which the request/response buffers are allocated
  *
  * Return: fwio context on success, NULL on failure.
  */
 struct fw_io_ctx *fw_io_setup(int device_index, void __iomem *bar0, u64 bar0_size,
-			      void __iomem *bar2, u64 bar2_size);
+			      void __iomem *bar2, u64 bar2_size, int numa_node);
 
 /**
  * fw_io_destroy() - Removes previously setup FWIO.